@@ -5,28 +5,35 @@
 #include "ray.hpp"
 #include "vec3.hpp"
 
-struct aabb {
-	vec3 minimum;
-	vec3 maximum;
+template<typename T>
+struct aabb_t {
+	vec3_t<T> minimum;
+	vec3_t<T> maximum;
 
-	aabb() {}
-	aabb(const vec3& a, const vec3& b) : minimum{a}, maximum{b} {}
+	aabb_t() {}
+	aabb_t(const vec3_t<T>& a, const vec3_t<T>& b) : minimum{a}, maximum{b} {}
 
-	inline bool hit(const ray& r, double t_min, double t_max) const {
+	inline bool hit(const ray_t<T>& r, T t_min, T t_max) const {
+
+		// Widening the far distance by the rounding error of the slab
+		// computation keeps the test conservative, see PBRT section 3.9.2
+		constexpr T widen = 1 + 2 * gamma_bound<T>(3);
 
 		for (int a = 0; a < 3; a++) {
 
-			auto inverse_direction = 1.0f / r.direction[a];
+			auto inverse_direction = T(1) / r.direction[a];
 			auto t0 = (minimum[a] - r.origin[a]) * inverse_direction;
 			auto t1 = (maximum[a] - r.origin[a]) * inverse_direction;
 
-			if (inverse_direction < 0.0f)
+			if (inverse_direction < 0)
 				std::swap(t0, t1);
 
+			t1 *= widen;
+
 			t_min = t0 > t_min ? t0 : t_min;
 			t_max = t1 < t_max ? t1 : t_max;
 
-			if (t_max <= t_min)
+			if (t_max < t_min)
 				return false;
 		}
 
@@ -34,14 +41,17 @@ struct aabb {
 	}
 };
 
-aabb surrounding_box(aabb box1, aabb box2) {
-	vec3 minimum(fmin(box1.minimum.x, box2.minimum.x),
-	             fmin(box1.minimum.y, box2.minimum.y),
-	             fmin(box1.minimum.z, box2.minimum.z));
+using aabb = aabb_t<real>;
+
+template<typename T>
+aabb_t<T> surrounding_box(const aabb_t<T>& box1, const aabb_t<T>& box2) {
+	vec3_t<T> minimum(std::fmin(box1.minimum.x, box2.minimum.x),
+	                  std::fmin(box1.minimum.y, box2.minimum.y),
+	                  std::fmin(box1.minimum.z, box2.minimum.z));
 
-	vec3 maximum(fmax(box1.maximum.x, box2.maximum.x),
-	             fmax(box1.maximum.y, box2.maximum.y),
-	             fmax(box1.maximum.z, box2.maximum.z));
+	vec3_t<T> maximum(std::fmax(box1.maximum.x, box2.maximum.x),
+	                  std::fmax(box1.maximum.y, box2.maximum.y),
+	                  std::fmax(box1.maximum.z, box2.maximum.z));
 
-	return aabb(minimum, maximum);
-}
\ No newline at end of file
+	return aabb_t<T>(minimum, maximum);
+}
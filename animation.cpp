@@ -0,0 +1,404 @@
+// Renders a camera orbit around a scene whose objects move, reusing the
+// samples of each frame in the next one.
+//
+//     g++ -O3 -fopenmp animation.cpp -o animation && ./animation
+//
+// Every pixel's first hit is traced through its center to find the surface
+// it shows. That point is moved back by the object's velocity and projected
+// into the previous frame's camera, and the history there is kept if the
+// surface found then matches in depth, normal and material. Pixels with a
+// long history only get MIN_SAMPLES new samples, while disoccluded ones get
+// TARGET_SAMPLES. History is kept divided by the albedo the pixel sees, so
+// textures stay sharp while the light on them is reused, and before blending
+// it is clamped to the spread of the new samples around the pixel, which
+// keeps edges and shading changes from leaving trails. Pixels that see the
+// background reuse history along their direction. Glass and metal look
+// different from every angle, so they keep no history. With TEMPORAL off
+// every frame starts from zero, for comparison.
+//
+// Frames are written as PNG to FRAME_DIRECTORY, and one line per frame with
+// its average new samples per pixel, share of pixels without history and
+// time goes to standard output.
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
+#include "camera.hpp"
+#include "image_writer.hpp"
+#include "light_tree.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scenes.hpp"
+#include "static_scene.hpp"
+#include "utils.hpp"
+
+constexpr int WIDTH = 320;
+constexpr int HEIGHT = 180;
+constexpr int MAX_RAY_DEPTH = 8;
+
+constexpr int SCENE = 1;
+constexpr int FRAMES = 48;
+
+// Degrees the camera turns around the scene over the whole sequence
+constexpr double ORBIT_DEGREES = 30;
+
+constexpr bool TEMPORAL = true;
+
+// Samples a pixel aims for, counting the ones carried over from history,
+// and the fewest new ones it takes every frame
+constexpr int TARGET_SAMPLES = 64;
+constexpr int MIN_SAMPLES = 4;
+
+// History counts for at most this many samples, so changes in lighting
+// fade in within a few frames
+constexpr int MAX_HISTORY = 256;
+
+// Largest relative depth difference and smallest normal cosine between a
+// surface and the history it reuses
+constexpr real DEPTH_TOLERANCE = 0.05;
+constexpr real NORMAL_TOLERANCE = 0.9;
+
+// History is clamped to the mean of the new samples in the 3x3 pixels
+// around it, give or take this many standard deviations
+constexpr real CLAMP_DEVIATIONS = 1.5;
+
+// Primary rays per pixel that find the albedo history is divided by
+constexpr int ALBEDO_SAMPLES = 16;
+
+constexpr sampler_type SAMPLER = sampler_type::sobol;
+
+constexpr const char* FRAME_DIRECTORY = "frames";
+
+// First hit through a pixel's center. Pixels that miss everything keep the
+// direction of the ray as their point.
+struct surface_sample {
+	bool valid = false;
+	bool miss = false;
+	vec3 point;
+	vec3 normal;
+	vec3 velocity;
+	real depth = 0;
+	uintptr_t material = 0;
+};
+
+// Mean radiance of a pixel divided by its albedo, and how many samples it
+// stands for
+struct pixel_history {
+	vec3 mean;
+	int samples = 0;
+};
+
+camera frame_camera(int frame, real time) {
+	const auto angle = ORBIT_DEGREES * M_PI / 180 * frame / std::max(FRAMES - 1, 1);
+	const vec3 start(13, 2, 3);
+	const vec3 origin(start.x * std::cos(angle) - start.z * std::sin(angle), start.y, start.x * std::sin(angle) + start.z * std::cos(angle));
+
+	camera c(origin, vec3(0, 0, 0), vec3(0, 1, 0), M_PI / 9, real(WIDTH) / HEIGHT, 0, 10, time, time);
+	c.set_image_height(HEIGHT);
+	return c;
+}
+
+// Screen coordinates of the center of pixel (x, y), y = 0 being the top row
+real pixel_h(real x) {
+	return (x + real(0.5)) / (WIDTH - 1);
+}
+
+real pixel_v(real y) {
+	return (HEIGHT - 1 - y + real(0.5)) / (HEIGHT - 1);
+}
+
+template<typename Scene>
+surface_sample first_hit(const camera& c, const Scene& scene, int x, int y, sampler& s) {
+	surface_sample result;
+
+	const auto r = c.shoot_ray(pixel_h(x), pixel_v(y), s);
+
+	hit info;
+	if (!scene.test_hit(r, RAY_T_MIN, INFINITY, info)) {
+		result.valid = result.miss = true;
+		result.point = unit_vector(r.direction);
+		return result;
+	}
+
+	if (!scene.diffuse(info))
+		return result;
+
+	result.valid = true;
+	result.point = info.point;
+	result.normal = info.normal;
+	result.depth = info.parameter * r.direction.length();
+
+	if (info.object) {
+		result.velocity = info.object->motion();
+		result.material = reinterpret_cast<uintptr_t>(info.object->surface_material().get());
+	}
+
+	return result;
+}
+
+// Albedo over the pixel's footprint, the background's where rays miss
+template<typename Scene>
+vec3 pixel_albedo(const camera& c, const Scene& scene, const vec3& background, int x, int y, sampler& s) {
+	vec3 sum(0, 0, 0);
+	for (int k = 0; k < ALBEDO_SAMPLES; k++) {
+		s.start_sample(x, y, k);
+
+		real du, dv;
+		s.get_2d(du, dv);
+
+		const auto r = c.shoot_ray((x + du) / (WIDTH - 1), (HEIGHT - 1 - y + dv) / (HEIGHT - 1), s);
+
+		hit info;
+		sum += scene.test_hit(r, RAY_T_MIN, INFINITY, info) ? scene.surface_albedo(info) : background;
+	}
+	return sum / ALBEDO_SAMPLES;
+}
+
+// Channels with next to no albedo are kept as they are
+real demodulate(real radiance, real albedo) {
+	return albedo > real(0.001) ? radiance / albedo : radiance;
+}
+
+real modulate(real irradiance, real albedo) {
+	return albedo > real(0.001) ? irradiance * albedo : irradiance;
+}
+
+vec3 demodulate(const vec3& radiance, const vec3& albedo) {
+	return vec3(demodulate(radiance.x, albedo.x), demodulate(radiance.y, albedo.y), demodulate(radiance.z, albedo.z));
+}
+
+vec3 modulate(const vec3& irradiance, const vec3& albedo) {
+	return vec3(modulate(irradiance.x, albedo.x), modulate(irradiance.y, albedo.y), modulate(irradiance.z, albedo.z));
+}
+
+// Catmull-Rom weights of the four pixels around a point at offset t from
+// the second one
+void catmull_rom(real t, real w[4]) {
+	w[0] = t * (-real(0.5) + t * (1 - real(0.5) * t));
+	w[1] = 1 + t * t * (-real(2.5) + real(1.5) * t);
+	w[2] = t * (real(0.5) + t * (2 - real(1.5) * t));
+	w[3] = t * t * (-real(0.5) + real(0.5) * t);
+}
+
+// History of the surface seen now, filtered from the previous frame. Where
+// the 4x4 pixels around it all saw the same surface that is a Catmull-Rom
+// filter, which keeps textures from blurring as history is resampled frame
+// after frame. Elsewhere it is bilinear over the neighbours that agree.
+pixel_history reproject(const surface_sample& current, real time, const camera& previous_camera, real previous_time,
+                        const std::vector<surface_sample>& previous_surfaces, const std::vector<pixel_history>& previous_history) {
+	pixel_history result;
+	if (!current.valid)
+		return result;
+
+	const auto point = current.miss
+		? previous_camera.origin + current.point
+		: current.point - (time - previous_time) * current.velocity;
+
+	real h, v;
+	if (!previous_camera.project(point, h, v))
+		return result;
+
+	const auto expected_depth = (point - previous_camera.origin).length();
+
+	const auto agrees = [&](int px, int py) {
+		if (px < 0 || py < 0 || px >= WIDTH || py >= HEIGHT)
+			return false;
+
+		const auto& before = previous_surfaces[py * WIDTH + px];
+		if (!before.valid || before.miss != current.miss)
+			return false;
+		if (current.miss)
+			return true;
+
+		return before.material == current.material && dot(before.normal, current.normal) >= NORMAL_TOLERANCE
+		    && std::fabs(before.depth - expected_depth) <= DEPTH_TOLERANCE * expected_depth;
+	};
+
+	const auto x = h * (WIDTH - 1) - real(0.5);
+	const auto y = (HEIGHT - 1) - v * (HEIGHT - 1) + real(0.5);
+	const int x0 = std::floor(x);
+	const int y0 = std::floor(y);
+
+	vec3 mean(0, 0, 0);
+	real samples = 0;
+	real total_weight = 0;
+	bool all_agree = true;
+
+	for (int dy = -1; dy < 3; dy++)
+		for (int dx = -1; dx < 3; dx++) {
+			const int px = x0 + dx;
+			const int py = y0 + dy;
+			if (!agrees(px, py)) {
+				all_agree = false;
+				continue;
+			}
+			if (dx < 0 || dy < 0 || dx > 1 || dy > 1)
+				continue;
+
+			const auto& history = previous_history[py * WIDTH + px];
+			const auto weight = (dx ? x - x0 : 1 - (x - x0)) * (dy ? y - y0 : 1 - (y - y0));
+
+			mean += weight * history.mean;
+			samples += weight * history.samples;
+			total_weight += weight;
+		}
+
+	// Too little of the footprint agrees to trust the rest
+	if (total_weight < real(0.25))
+		return result;
+
+	result.mean = mean / total_weight;
+	result.samples = samples / total_weight;
+
+	if (all_agree) {
+		real wx[4], wy[4];
+		catmull_rom(x - x0, wx);
+		catmull_rom(y - y0, wy);
+
+		result.mean = vec3(0, 0, 0);
+		for (int dy = 0; dy < 4; dy++)
+			for (int dx = 0; dx < 4; dx++)
+				result.mean += wx[dx] * wy[dy] * previous_history[(y0 + dy - 1) * WIDTH + x0 + dx - 1].mean;
+	}
+
+	return result;
+}
+
+int main() {
+	const double start_time = 0;
+	const double end_time = 1;
+
+	const vec3 background(0.5, 0.5, 0.5);
+
+	random_generator().seed(SCENE);
+
+	scene_arena arena;
+	const auto world = choose_scene(SCENE, arena);
+	const light_tree lights(world, start_time, end_time);
+	const static_scene scene(world, start_time, end_time, &lights);
+
+	std::filesystem::create_directories(FRAME_DIRECTORY);
+
+	std::vector<surface_sample> surfaces(WIDTH * HEIGHT), previous_surfaces(WIDTH * HEIGHT);
+	std::vector<pixel_history> history(WIDTH * HEIGHT), previous_history(WIDTH * HEIGHT);
+	std::vector<pixel_history> past(WIDTH * HEIGHT), current(WIDTH * HEIGHT);
+	std::vector<vec3> albedo(WIDTH * HEIGHT);
+
+	// Samples each pixel drew so far, so every frame continues its sequence
+	std::vector<int> drawn(WIDTH * HEIGHT, 0);
+
+	real previous_time = 0;
+	camera previous_camera = frame_camera(0, 0);
+
+	std::cout << "frame,spp,disoccluded,seconds\n";
+
+	for (int frame = 0; frame < FRAMES; frame++) {
+		const auto start = std::chrono::steady_clock::now();
+
+		// Objects move over the time the scene was built for
+		const real time = start_time + (end_time - start_time) * frame / std::max(FRAMES - 1, 1);
+		const auto c = frame_camera(frame, time);
+
+		long new_samples = 0;
+		long disoccluded = 0;
+
+		#pragma omp parallel reduction(+ : new_samples, disoccluded)
+		{
+			auto pixel_sampler = make_sampler(SAMPLER, TARGET_SAMPLES);
+			sampler& s = *pixel_sampler;
+
+			#pragma omp for schedule(dynamic)
+			for (int y = 0; y < HEIGHT; y++)
+				for (int x = 0; x < WIDTH; x++) {
+					const auto p = y * WIDTH + x;
+
+					s.start_sample(x, y, 0);
+					surfaces[p] = first_hit(c, scene, x, y, s);
+					albedo[p] = pixel_albedo(c, scene, background, x, y, s);
+
+					past[p] = pixel_history();
+					if (TEMPORAL && frame > 0)
+						past[p] = reproject(surfaces[p], time, previous_camera, previous_time, previous_surfaces, previous_history);
+
+					if (past[p].samples == 0)
+						disoccluded++;
+
+					const int count = std::max(MIN_SAMPLES, TARGET_SAMPLES - past[p].samples);
+
+					vec3 color(0, 0, 0);
+					for (int k = 0; k < count; k++) {
+						s.start_sample(x, y, drawn[p] + k);
+
+						real du, dv;
+						s.get_2d(du, dv);
+
+						const auto r = c.shoot_ray((x + du) / (WIDTH - 1), (HEIGHT - 1 - y + dv) / (HEIGHT - 1), s);
+						color += ray_color(r, background, scene, s, MAX_RAY_DEPTH);
+					}
+
+					current[p].mean = demodulate(color / count, albedo[p]);
+					current[p].samples = count;
+					drawn[p] += count;
+					new_samples += count;
+				}
+
+			#pragma omp for schedule(static)
+			for (int y = 0; y < HEIGHT; y++)
+				for (int x = 0; x < WIDTH; x++) {
+					const auto p = y * WIDTH + x;
+
+					auto reused = past[p].mean;
+					if (past[p].samples > 0) {
+						vec3 sum(0, 0, 0), sum_squared(0, 0, 0);
+						int n = 0;
+						for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, HEIGHT - 1); ny++)
+							for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, WIDTH - 1); nx++) {
+								const auto& m = current[ny * WIDTH + nx].mean;
+								sum += m;
+								sum_squared += m * m;
+								n++;
+							}
+
+						const auto mean = sum / n;
+						const auto variance = sum_squared / n - mean * mean;
+						const vec3 spread(std::sqrt(std::max(variance.x, real(0))), std::sqrt(std::max(variance.y, real(0))),
+						                  std::sqrt(std::max(variance.z, real(0))));
+
+						const auto low = mean - CLAMP_DEVIATIONS * spread;
+						const auto high = mean + CLAMP_DEVIATIONS * spread;
+						reused = vec3(std::clamp(reused.x, low.x, high.x), std::clamp(reused.y, low.y, high.y),
+						              std::clamp(reused.z, low.z, high.z));
+					}
+
+					const auto total = past[p].samples + current[p].samples;
+					history[p].mean = (reused * past[p].samples + current[p].mean * current[p].samples) / total;
+					history[p].samples = std::min(total, MAX_HISTORY);
+				}
+		}
+
+		char path[256];
+		std::snprintf(path, sizeof(path), "%s/frame_%04d.png", FRAME_DIRECTORY, frame);
+
+		image_writer output(image_format::png, WIDTH, HEIGHT, [&](int x, int y) {
+			return modulate(history[y * WIDTH + x].mean, albedo[y * WIDTH + x]);
+		});
+		if (!output.write(path))
+			std::cerr << "Could not write " << path << '\n';
+
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		std::cout << frame << ',' << double(new_samples) / (WIDTH * HEIGHT) << ','
+		          << double(disoccluded) / (WIDTH * HEIGHT) << ',' << elapsed.count() << std::endl;
+
+		std::swap(surfaces, previous_surfaces);
+		std::swap(history, previous_history);
+		previous_camera = c;
+		previous_time = time;
+	}
+}
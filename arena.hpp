@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator. Memory comes out of large blocks in allocation order and
+// is only given back when the arena itself goes away.
+struct monotonic_arena {
+
+	static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+	std::vector<std::unique_ptr<std::byte[]>> blocks;
+	std::byte* current = nullptr;
+	size_t remaining = 0;
+
+	size_t reserved = 0;
+	size_t used = 0;
+	size_t objects = 0;
+
+	void* allocate(size_t size, size_t alignment) {
+		void* pointer = current;
+
+		if (!current || !std::align(alignment, size, pointer, remaining)) {
+			const auto block_size = std::max(BLOCK_SIZE, size + alignment);
+			blocks.push_back(std::make_unique<std::byte[]>(block_size));
+			reserved += block_size;
+
+			pointer = current = blocks.back().get();
+			remaining = block_size;
+			std::align(alignment, size, pointer, remaining);
+		}
+
+		current = static_cast<std::byte*>(pointer) + size;
+		remaining -= size;
+		used += size;
+		objects++;
+
+		return pointer;
+	}
+};
+
+enum class arena_category {
+	primitives,
+	bvh,
+	materials,
+	textures,
+};
+
+// Owns every object of a scene. Each category gets its own arena, so for
+// example BVH nodes end up next to each other in memory.
+//
+// The shared pointers handed out don't own anything and carry no control
+// block: the scene_arena must outlive every object made from it.
+struct scene_arena {
+
+	static constexpr int CATEGORIES = 4;
+
+	monotonic_arena arenas[CATEGORIES];
+	std::vector<std::pair<void*, void (*)(void*)>> destructors;
+
+	scene_arena() = default;
+	scene_arena(const scene_arena&) = delete;
+	scene_arena& operator=(const scene_arena&) = delete;
+
+	~scene_arena() {
+		for (auto it = destructors.rbegin(); it != destructors.rend(); ++it)
+			it->second(it->first);
+	}
+
+	template<typename T, typename... Args>
+	std::shared_ptr<T> make(arena_category category, Args&&... args) {
+		void* memory = arenas[static_cast<int>(category)].allocate(sizeof(T), alignof(T));
+		T* object = new (memory) T(std::forward<Args>(args)...);
+
+		if (!std::is_trivially_destructible_v<T>)
+			destructors.emplace_back(object, [](void* p) { static_cast<T*>(p)->~T(); });
+
+		return std::shared_ptr<T>(std::shared_ptr<T>(), object);
+	}
+
+	template<typename T, typename... Args>
+	std::shared_ptr<T> make_primitive(Args&&... args) {
+		return make<T>(arena_category::primitives, std::forward<Args>(args)...);
+	}
+
+	template<typename T, typename... Args>
+	std::shared_ptr<T> make_node(Args&&... args) {
+		return make<T>(arena_category::bvh, std::forward<Args>(args)...);
+	}
+
+	template<typename T, typename... Args>
+	std::shared_ptr<T> make_material(Args&&... args) {
+		return make<T>(arena_category::materials, std::forward<Args>(args)...);
+	}
+
+	template<typename T, typename... Args>
+	std::shared_ptr<T> make_texture(Args&&... args) {
+		return make<T>(arena_category::textures, std::forward<Args>(args)...);
+	}
+
+	void report(std::ostream& out) const {
+		static const char* names[CATEGORIES] = {"primitives", "bvh", "materials", "textures"};
+
+		size_t total_used = 0;
+		size_t total_reserved = 0;
+
+		out << "Scene memory:\n";
+		for (int c = 0; c < CATEGORIES; c++) {
+			const auto& arena = arenas[c];
+			out << "  " << names[c] << ": " << arena.objects << " objects, "
+			    << arena.used << " bytes used, " << arena.reserved << " bytes reserved\n";
+
+			total_used += arena.used;
+			total_reserved += arena.reserved;
+		}
+		out << "  total: " << total_used << " bytes used, " << total_reserved << " bytes reserved\n";
+	}
+};
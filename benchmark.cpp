@@ -0,0 +1,97 @@
+// Times every built-in scene through the virtual interfaces (bvh_node) and
+// through static_scene, and prints one line per scene with the speedup.
+// static_scene is timed with both its BVH and its uniform grid, and the last
+// column names the faster of the two for that scene.
+//
+//     g++ -O3 -fopenmp benchmark.cpp -o benchmark && ./benchmark
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+
+#include "arena.hpp"
+#include "bvh_node.hpp"
+#include "camera.hpp"
+#include "light_tree.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scenes.hpp"
+#include "static_scene.hpp"
+
+constexpr int WIDTH = 160;
+constexpr int HEIGHT = 160;
+constexpr int SAMPLES = 64;
+constexpr int MAX_RAY_DEPTH = 2;
+
+// Each core is timed this many times, interleaved, keeping the fastest run
+constexpr int REPEATS = 3;
+
+// Returns the render time in seconds
+template<typename Scene>
+double time_render(const camera& c, const vec3& background, const Scene& scene) {
+	const auto start = std::chrono::steady_clock::now();
+
+	#pragma omp parallel
+	{
+		auto pixel_sampler = make_sampler(sampler_type::sobol, SAMPLES);
+		sampler& s = *pixel_sampler;
+
+		#pragma omp for schedule(dynamic)
+		for (int j = 0; j < HEIGHT; ++j)
+			for (int i = 0; i < WIDTH; ++i)
+				for (int k = 0; k < SAMPLES; k++) {
+					s.start_sample(i, j, k);
+
+					real du, dv;
+					s.get_2d(du, dv);
+
+					ray r = c.shoot_ray((i + du) / (WIDTH - 1), (j + dv) / (HEIGHT - 1), s);
+					ray_color(r, background, scene, s, MAX_RAY_DEPTH);
+				}
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+int main() {
+	const double start_time = 0;
+	const double end_time = 1;
+	const double samples = double(WIDTH) * HEIGHT * SAMPLES;
+
+	const vec3 background(0.5, 0.5, 0.5);
+	camera c(vec3(0, 0, 100), vec3(0, 0, -100), vec3(0, 1, 0), M_PI / 4, 1, 0.1, 10);
+	c.set_image_height(HEIGHT);
+
+	std::cout << "scene,virtual_s,static_s,grid_s,virtual_samples_per_s,static_samples_per_s,grid_samples_per_s,speedup,best\n";
+
+	for (int id = 1; id <= SCENES; id++) {
+		scene_arena arena;
+		const auto world = choose_scene(id, arena);
+
+		bvh_node bvh(world, start_time, end_time, &arena);
+		light_tree lights(world, start_time, end_time);
+		static_scene closed_world(world, start_time, end_time, &lights);
+
+		static_scene gridded = closed_world;
+		gridded.select(accelerator::grid);
+
+		double virtual_time = INFINITY;
+		double static_time = INFINITY;
+		double grid_time = INFINITY;
+
+		for (int k = 0; k < REPEATS; k++) {
+			virtual_time = std::min(virtual_time, time_render(c, background, dynamic_scene(bvh, &lights)));
+			static_time = std::min(static_time, time_render(c, background, closed_world));
+			grid_time = std::min(grid_time, time_render(c, background, gridded));
+		}
+
+		std::cout << scene_name(id) << ','
+		          << virtual_time << ',' << static_time << ',' << grid_time << ','
+		          << samples / virtual_time << ',' << samples / static_time << ',' << samples / grid_time << ','
+		          << virtual_time / std::min(static_time, grid_time) << ','
+		          << (grid_time < static_time ? "grid" : "bvh") << '\n';
+	}
+}
@@ -3,6 +3,7 @@
 #include <memory>
 #include <vector>
 
+#include "arena.hpp"
 #include "hittable.hpp"
 #include "hittable_list.hpp"
 #include "utils.hpp"
@@ -36,10 +37,11 @@ struct bvh_node : hittable {
 
 	bvh_node() = default;
 
-	bvh_node(const hittable_list& list, double t_min, double t_max)
-	    : bvh_node(list.objects, 0, list.objects.size(), t_min, t_max) {}
+	// Inner nodes are allocated from the arena when one is given
+	bvh_node(const hittable_list& list, real t_min, real t_max, scene_arena* arena = nullptr)
+	    : bvh_node(list.objects, 0, list.objects.size(), t_min, t_max, arena) {}
 
-	bvh_node(const std::vector<std::shared_ptr<hittable>>& src_objects, size_t start, size_t end, double t_min, double t_max) {
+	bvh_node(const std::vector<std::shared_ptr<hittable>>& src_objects, size_t start, size_t end, real t_min, real t_max, scene_arena* arena = nullptr) {
 		auto objects = src_objects;  // Create a modifiable array of the source scene objects
 
 		int axis = random_int(0, 2);
@@ -64,8 +66,13 @@ struct bvh_node : hittable {
 			std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
 			auto mid = (start + end) / 2;
-			left = std::make_shared<bvh_node>(objects, start, mid, t_min, t_max);
-			right = std::make_shared<bvh_node>(objects, mid, end, t_min, t_max);
+			if (arena) {
+				left = arena->make_node<bvh_node>(objects, start, mid, t_min, t_max, arena);
+				right = arena->make_node<bvh_node>(objects, mid, end, t_min, t_max, arena);
+			} else {
+				left = std::make_shared<bvh_node>(objects, start, mid, t_min, t_max);
+				right = std::make_shared<bvh_node>(objects, mid, end, t_min, t_max);
+			}
 		}
 
 		aabb box_left, box_right;
@@ -76,17 +83,32 @@ struct bvh_node : hittable {
 		box = surrounding_box(box_left, box_right);
 	};
 
-	bool test_hit(const ray& r, double t_min, double t_max, hit& hit_record) const override {
+	bool test_hit(const ray& r, real t_min, real t_max, hit& hit_record) const override {
+		if (!test_intersection(r, t_min, t_max, hit_record))
+			return false;
+
+		finish_hit(r, hit_record);
+		return true;
+	}
+
+	bool test_intersection(const ray& r, real t_min, real t_max, hit& hit_record) const override {
 		if (!box.hit(r, t_min, t_max))
 			return false;
 
-		bool hit_left = left->test_hit(r, t_min, t_max, hit_record);
-		bool hit_right = right->test_hit(r, t_min, hit_left ? hit_record.parameter : t_max, hit_record);
+		bool hit_left = left->test_intersection(r, t_min, t_max, hit_record);
+		bool hit_right = right->test_intersection(r, t_min, hit_left ? hit_record.parameter : t_max, hit_record);
 
 		return hit_left || hit_right;
 	}
 
-	bool bounding_box(double t_min, double t_max, aabb& output_box) const override {
+	bool test_occluded(const ray& r, real t_min, real t_max) const override {
+		if (!box.hit(r, t_min, t_max))
+			return false;
+
+		return left->test_occluded(r, t_min, t_max) || right->test_occluded(r, t_min, t_max);
+	}
+
+	bool bounding_box(real t_min, real t_max, aabb& output_box) const override {
 		output_box = box;
 		return true;
 	}
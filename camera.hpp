@@ -3,6 +3,7 @@
 #include "vec3.hpp"
 #include "ray.hpp"
 #include "utils.hpp"
+#include "sampler.hpp"
 
 struct camera {
 	vec3 origin;
@@ -16,21 +17,24 @@ struct camera {
 	vec3 right;
 	vec3 up;
 
-	double lens_radius;
+	real lens_radius;
 
-	double open_time;
-	double close_time;
+	real open_time;
+	real close_time;
+
+	// Angle covered by one pixel, zero until the resolution is known
+	real pixel_spread = 0;
 
 	camera(
 		vec3 origin,
 		vec3 lookat,
 		vec3 world_up,
-		double vertical_fov,
-		double aspect_ratio,
-		double aperture,
-		double focus_distance,
-		double open_time = 0.0,
-		double close_time = 0.0
+		real vertical_fov,
+		real aspect_ratio,
+		real aperture,
+		real focus_distance,
+		real open_time = 0,
+		real close_time = 0
 	) : origin{origin}, open_time{open_time}, close_time{close_time} {
 		back = unit_vector(origin - lookat);
 		right = unit_vector(cross(world_up, back));
@@ -50,12 +54,36 @@ struct camera {
 		lens_radius = aperture / 2;
 	}
 
-	ray shoot_ray(double h, double v) const {
-		vec3 random_start = lens_radius * random_in_unit_disk();
+	void set_image_height(int image_height) {
+		pixel_spread = vertical.length() / (focal_length.length() * image_height);
+	}
+
+	// Screen coordinates h and v of the point, as taken by shoot_ray, seen
+	// through the center of the lens. False for points behind the camera.
+	bool project(const vec3& point, real& h, real& v) const {
+		const auto direction = point - origin;
+		const auto distance = dot(direction, -back);
+		if (distance <= 0)
+			return false;
+
+		const auto on_plane = direction * (focal_length.length() / distance) - focal_length;
+		h = dot(on_plane, right) / horizontal.length() + real(0.5);
+		v = dot(on_plane, up) / vertical.length() + real(0.5);
+		return true;
+	}
+
+	ray shoot_ray(real h, real v, sampler& s) const {
+		real u1, u2;
+		s.get_2d(u1, u2);
+
+		vec3 random_start = lens_radius * random_in_unit_disk(u1, u2);
 		vec3 random_origin = origin + right * random_start.x + up * random_start.y;
 		vec3 position = h * horizontal + v * vertical;
-		double random_time = random_double(open_time, close_time);
+		real random_time = open_time + (close_time - open_time) * s.get_1d();
+
+		ray r(random_origin, lower_left_corner - random_origin + position, random_time);
+		r.spread = pixel_spread;
 
-		return ray(random_origin, lower_left_corner - random_origin + position, random_time);
+		return r;
 	}
 };
@@ -0,0 +1,154 @@
+// Measures time to quality. Every scene is rendered at 1, 2, 4, ...
+// samples per pixel and compared with a high sample count reference, and
+// each render prints one CSV line with its error and efficiency.
+//
+//     g++ -O3 -fopenmp convergence.cpp -o convergence && ./convergence > convergence.csv
+//
+// References are rendered on the first run and cached as PFM files in
+// REFERENCE_DIRECTORY, named after the settings they were made with, so
+// changing those renders new ones. Delete them after a change that is meant
+// to alter the converged image.
+//
+// Columns are scene, spp, seconds, rmse, relmse and efficiency, where
+// efficiency = 1 / (relmse * seconds). Comparing the efficiency of two
+// builds at the same spp says which one gets to a given quality sooner.
+
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
+#include "bvh_node.hpp"
+#include "camera.hpp"
+#include "image.hpp"
+#include "light_tree.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scenes.hpp"
+#include "static_scene.hpp"
+#include "utils.hpp"
+
+constexpr int WIDTH = 128;
+constexpr int HEIGHT = 128;
+constexpr int MAX_RAY_DEPTH = 2;
+
+constexpr int MAX_SAMPLES = 256;
+constexpr int REFERENCE_SAMPLES = 4096;
+
+// The reference uses independent samples, so it isn't correlated with the
+// prefix of the sequence the measured renders take
+constexpr sampler_type SAMPLER = sampler_type::sobol;
+constexpr sampler_type REFERENCE_SAMPLER = sampler_type::independent;
+
+constexpr const char* REFERENCE_DIRECTORY = "references";
+
+// Keeps relMSE finite on black pixels
+constexpr double RELATIVE_EPSILON = 1e-2;
+
+// The scenes that render without external assets
+constexpr int CONVERGENCE_SCENES = 5;
+
+// Mean radiance of every pixel, rows of WIDTH top row first
+template<typename Scene>
+std::vector<vec3> render(const camera& c, const vec3& background, const Scene& scene, int spp, sampler_type type) {
+	std::vector<vec3> image(WIDTH * HEIGHT);
+
+	#pragma omp parallel
+	{
+		auto pixel_sampler = make_sampler(type, spp);
+		sampler& s = *pixel_sampler;
+
+		#pragma omp for schedule(dynamic)
+		for (int j = 0; j < HEIGHT; ++j)
+			for (int i = 0; i < WIDTH; ++i) {
+				vec3 color(0, 0, 0);
+				for (int k = 0; k < spp; k++) {
+					s.start_sample(i, j, k);
+
+					real du, dv;
+					s.get_2d(du, dv);
+
+					ray r = c.shoot_ray((i + du) / (WIDTH - 1), (j + dv) / (HEIGHT - 1), s);
+					color += ray_color(r, background, scene, s, MAX_RAY_DEPTH);
+				}
+
+				image[(HEIGHT - 1 - j) * WIDTH + i] = color / spp;
+			}
+	}
+
+	return image;
+}
+
+struct image_error {
+	double rmse = 0;
+	double relmse = 0;
+};
+
+image_error compare(const std::vector<vec3>& image, const std::vector<vec3>& reference) {
+	image_error error;
+
+	for (size_t p = 0; p < image.size(); p++)
+		for (int c = 0; c < 3; c++) {
+			const double difference = image[p][c] - reference[p][c];
+			const double expected = reference[p][c];
+
+			error.rmse += difference * difference;
+			error.relmse += difference * difference / (expected * expected + RELATIVE_EPSILON);
+		}
+
+	error.rmse = std::sqrt(error.rmse / (3 * image.size()));
+	error.relmse /= 3 * image.size();
+
+	return error;
+}
+
+int main() {
+	const double start_time = 0;
+	const double end_time = 1;
+
+	const vec3 background(0.5, 0.5, 0.5);
+	camera c(vec3(0, 0, 100), vec3(0, 0, -100), vec3(0, 1, 0), M_PI / 4, real(WIDTH) / HEIGHT, 0.1, 10);
+	c.set_image_height(HEIGHT);
+
+	std::filesystem::create_directories(REFERENCE_DIRECTORY);
+
+	std::cout << "scene,spp,seconds,rmse,relmse,efficiency\n";
+
+	for (int id = 1; id <= CONVERGENCE_SCENES; id++) {
+		// Scenes with random content come out the same in every run
+		random_generator().seed(id);
+
+		scene_arena arena;
+		const auto world = choose_scene(id, arena);
+		const light_tree lights(world, start_time, end_time);
+		const static_scene scene(world, start_time, end_time, &lights);
+
+		std::ostringstream path;
+		path << REFERENCE_DIRECTORY << '/' << scene_name(id) << '_' << WIDTH << 'x' << HEIGHT
+		     << '_' << REFERENCE_SAMPLES << "spp_depth" << MAX_RAY_DEPTH << ".pfm";
+
+		int width, height;
+		std::vector<vec3> reference;
+		if (!read_pfm(path.str().c_str(), width, height, reference) || width != WIDTH || height != HEIGHT) {
+			std::cerr << "Rendering reference " << path.str() << '\n';
+			reference = render(c, background, scene, REFERENCE_SAMPLES, REFERENCE_SAMPLER);
+			write_pfm(path.str().c_str(), WIDTH, HEIGHT, reference);
+		}
+
+		for (int spp = 1; spp <= MAX_SAMPLES; spp *= 2) {
+			const auto start = std::chrono::steady_clock::now();
+			const auto image = render(c, background, scene, spp, SAMPLER);
+			const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			const auto error = compare(image, reference);
+			const auto seconds = elapsed.count();
+
+			std::cout << scene_name(id) << ',' << spp << ',' << seconds << ','
+			          << error.rmse << ',' << error.relmse << ',' << 1 / (error.relmse * seconds) << std::endl;
+		}
+	}
+}
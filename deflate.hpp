@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Just enough of zlib to write PNG and EXR files. Data is compressed as a
+// single deflate block with the fixed Huffman codes of RFC 1951, matches
+// found greedily through hash chains. Pieces of a stream can be compressed
+// on their own and concatenated, which is how the image writers spread
+// compression over threads.
+
+constexpr int DEFLATE_WINDOW = 32768;
+constexpr int DEFLATE_MIN_MATCH = 3;
+constexpr int DEFLATE_MAX_MATCH = 258;
+constexpr int DEFLATE_MAX_CHAIN = 32;
+constexpr int DEFLATE_HASH_BITS = 15;
+
+inline uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+	static const auto table = [] {
+		std::vector<uint32_t> table(256);
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		return table;
+	}();
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+constexpr uint32_t ADLER_BASE = 65521;
+
+inline uint32_t adler32(const uint8_t* data, size_t size, uint32_t adler = 1) {
+	uint32_t a = adler & 0xffff;
+	uint32_t b = adler >> 16;
+
+	// 5552 bytes is the most that can be summed before b overflows
+	while (size > 0) {
+		const size_t run = std::min<size_t>(size, 5552);
+		for (size_t i = 0; i < run; i++) {
+			a += data[i];
+			b += a;
+		}
+		a %= ADLER_BASE;
+		b %= ADLER_BASE;
+		data += run;
+		size -= run;
+	}
+
+	return a | (b << 16);
+}
+
+// Checksum of two pieces from the checksum of each and the second's length
+inline uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size) {
+	const uint32_t remainder = second_size % ADLER_BASE;
+
+	uint32_t a = first & 0xffff;
+	uint32_t b = uint64_t(remainder) * a % ADLER_BASE;
+	a += (second & 0xffff) + ADLER_BASE - 1;
+	b += (first >> 16) + (second >> 16) + ADLER_BASE - remainder;
+
+	if (a >= ADLER_BASE)
+		a -= ADLER_BASE;
+	if (a >= ADLER_BASE)
+		a -= ADLER_BASE;
+	if (b >= 2 * ADLER_BASE)
+		b -= 2 * ADLER_BASE;
+	if (b >= ADLER_BASE)
+		b -= ADLER_BASE;
+
+	return a | (b << 16);
+}
+
+// Deflate packs bits starting from the least significant one
+struct bit_writer {
+
+	std::vector<uint8_t>& out;
+	uint64_t buffer = 0;
+	int count = 0;
+
+	bit_writer(std::vector<uint8_t>& out) : out{out} {}
+
+	void put(uint32_t bits, int n) {
+		buffer |= uint64_t(bits) << count;
+		count += n;
+		while (count >= 8) {
+			out.push_back(buffer & 0xff);
+			buffer >>= 8;
+			count -= 8;
+		}
+	}
+
+	// Huffman codes go in starting from their most significant bit
+	void put_code(uint32_t code, int length) {
+		uint32_t reversed = 0;
+		for (int k = 0; k < length; k++)
+			reversed |= ((code >> k) & 1) << (length - 1 - k);
+		put(reversed, length);
+	}
+
+	void align() {
+		if (count > 0)
+			out.push_back(buffer & 0xff);
+		buffer = 0;
+		count = 0;
+	}
+};
+
+namespace fixed_huffman {
+
+constexpr uint16_t LENGTH_BASE[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+constexpr uint8_t LENGTH_EXTRA[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+constexpr uint16_t DISTANCE_BASE[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+constexpr uint8_t DISTANCE_EXTRA[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+inline void put_symbol(bit_writer& bits, int symbol) {
+	if (symbol < 144)
+		bits.put_code(0x30 + symbol, 8);
+	else if (symbol < 256)
+		bits.put_code(0x190 + symbol - 144, 9);
+	else if (symbol < 280)
+		bits.put_code(symbol - 256, 7);
+	else
+		bits.put_code(0xc0 + symbol - 280, 8);
+}
+
+// Index of the last base not above value
+template<size_t N>
+int code_of(const uint16_t (&base)[N], int value) {
+	return std::upper_bound(base, base + N, value) - base - 1;
+}
+
+inline void put_match(bit_writer& bits, int length, int distance) {
+	const int l = code_of(LENGTH_BASE, length);
+	put_symbol(bits, 257 + l);
+	bits.put(length - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+
+	const int d = code_of(DISTANCE_BASE, distance);
+	bits.put_code(d, 5);
+	bits.put(distance - DISTANCE_BASE[d], DISTANCE_EXTRA[d]);
+}
+
+}
+
+// Appends data as one deflate block. A piece that isn't the last ends with
+// an empty stored block, which leaves the stream byte aligned so the next
+// piece can simply be appended.
+inline void deflate_piece(const uint8_t* data, size_t size, bool last, std::vector<uint8_t>& out) {
+	bit_writer bits(out);
+	bits.put(last ? 1 : 0, 1);
+	bits.put(1, 2);
+
+	const auto hash = [&](size_t i) {
+		const uint32_t key = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16);
+		return (key * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+	};
+
+	std::vector<int64_t> head(size_t(1) << DEFLATE_HASH_BITS, -1);
+	std::vector<int64_t> previous(DEFLATE_WINDOW, -1);
+
+	const auto insert = [&](size_t i) {
+		const auto h = hash(i);
+		previous[i % DEFLATE_WINDOW] = head[h];
+		head[h] = i;
+	};
+
+	size_t i = 0;
+	while (i < size) {
+		int best_length = 0;
+		size_t best_distance = 0;
+
+		if (i + DEFLATE_MIN_MATCH <= size) {
+			const int limit = std::min<size_t>(DEFLATE_MAX_MATCH, size - i);
+
+			int64_t candidate = head[hash(i)];
+			for (int chain = 0; chain < DEFLATE_MAX_CHAIN && candidate >= 0 && i - candidate <= DEFLATE_WINDOW; chain++) {
+				int length = 0;
+				while (length < limit && data[candidate + length] == data[i + length])
+					length++;
+
+				if (length > best_length) {
+					best_length = length;
+					best_distance = i - candidate;
+					if (length == limit)
+						break;
+				}
+
+				candidate = previous[candidate % DEFLATE_WINDOW];
+			}
+		}
+
+		if (best_length >= DEFLATE_MIN_MATCH) {
+			fixed_huffman::put_match(bits, best_length, best_distance);
+			for (int k = 0; k < best_length; k++, i++)
+				if (i + DEFLATE_MIN_MATCH <= size)
+					insert(i);
+		} else {
+			fixed_huffman::put_symbol(bits, data[i]);
+			if (i + DEFLATE_MIN_MATCH <= size)
+				insert(i);
+			i++;
+		}
+	}
+
+	fixed_huffman::put_symbol(bits, 256);
+
+	if (!last) {
+		bits.put(0, 3);
+		bits.align();
+		out.insert(out.end(), {0x00, 0x00, 0xff, 0xff});
+	} else {
+		bits.align();
+	}
+}
+
+inline void put_big_endian(std::vector<uint8_t>& out, uint32_t value) {
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out.push_back(value >> shift);
+}
+
+// A complete zlib stream: header, one deflate block and checksum
+inline std::vector<uint8_t> zlib_compress(const uint8_t* data, size_t size) {
+	std::vector<uint8_t> out = {0x78, 0x01};
+	deflate_piece(data, size, true, out);
+	put_big_endian(out, adler32(data, size));
+	return out;
+}
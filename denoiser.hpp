@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "vec3.hpp"
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010).
+//
+// Every buffer holds one value per pixel, indexed as i * height + j like the
+// screen array. Color is divided by albedo before filtering so textures stay
+// sharp, and the filter weights stop at normal, depth and color edges.
+
+struct denoiser_settings {
+	int iterations = 5;
+	double sigma_color = 1.0;
+	double sigma_normal = 64;
+	double sigma_depth = 0.05;
+};
+
+struct denoiser {
+
+	int width;
+	int height;
+	denoiser_settings settings;
+
+	denoiser(int width, int height, denoiser_settings settings = {})
+	    : width{width}, height{height}, settings{settings} {}
+
+	std::vector<vec3> run(const std::vector<vec3>& color,
+	                      const std::vector<vec3>& albedo,
+	                      const std::vector<vec3>& normal,
+	                      const std::vector<float>& depth) const {
+
+		const size_t size = static_cast<size_t>(width) * height;
+
+		std::vector<vec3> current(size);
+		std::vector<vec3> next(size);
+
+		#pragma omp parallel for
+		for (size_t p = 0; p < size; p++)
+			current[p] = demodulate(color[p], albedo[p]);
+
+		for (int k = 0; k < settings.iterations; k++) {
+			const int step = 1 << k;
+
+			// Later iterations see less noise, so color edges may be sharper
+			const double color_variance = settings.sigma_color * settings.sigma_color / step;
+
+			#pragma omp parallel for
+			for (int i = 0; i < width; i++)
+				for (int j = 0; j < height; j++)
+					next[index(i, j)] = filter_pixel(current, normal, depth, i, j, step, color_variance);
+
+			std::swap(current, next);
+		}
+
+		#pragma omp parallel for
+		for (size_t p = 0; p < size; p++)
+			current[p] = current[p] * albedo_or_white(albedo[p]);
+
+		return current;
+	}
+
+	size_t index(int i, int j) const {
+		return static_cast<size_t>(i) * height + j;
+	}
+
+	vec3 filter_pixel(const std::vector<vec3>& color,
+	                  const std::vector<vec3>& normal,
+	                  const std::vector<float>& depth,
+	                  int i, int j, int step, double color_variance) const {
+
+		// B3 spline, separable 5x5
+		static constexpr double kernel[5] = {1.0 / 16, 1.0 / 4, 3.0 / 8, 1.0 / 4, 1.0 / 16};
+
+		const auto p = index(i, j);
+
+		vec3 sum(0, 0, 0);
+		double weights = 0;
+
+		for (int dx = -2; dx <= 2; dx++) {
+			const int qi = i + dx * step;
+			if (qi < 0 || width <= qi)
+				continue;
+
+			for (int dy = -2; dy <= 2; dy++) {
+				const int qj = j + dy * step;
+				if (qj < 0 || height <= qj)
+					continue;
+
+				const auto q = index(qi, qj);
+
+				const auto color_distance = (compress(color[p]) - compress(color[q])).length_squared();
+				const auto w_color = std::exp(-color_distance / color_variance);
+
+				const auto cos_normal = std::fmax(0.0, dot(normal[p], normal[q]));
+				const auto w_normal = normal[p].zero() && normal[q].zero() ? 1.0 : std::pow(cos_normal, settings.sigma_normal);
+
+				const auto depth_scale = settings.sigma_depth * std::fmax(depth[p], depth[q]) + 1e-4;
+				const auto w_depth = std::exp(-std::fabs(depth[p] - depth[q]) / depth_scale);
+
+				const auto w = kernel[dx + 2] * kernel[dy + 2] * w_color * w_normal * w_depth;
+
+				sum += w * color[q];
+				weights += w;
+			}
+		}
+
+		return sum / weights;
+	}
+
+	// Bright outliers would otherwise never blend with their neighbours
+	static vec3 compress(const vec3& c) {
+		return vec3(c.x / (1 + c.x), c.y / (1 + c.y), c.z / (1 + c.z));
+	}
+
+	static vec3 albedo_or_white(const vec3& albedo) {
+		constexpr double e = 1e-3;
+		return vec3(albedo.x < e ? 1 : albedo.x, albedo.y < e ? 1 : albedo.y, albedo.z < e ? 1 : albedo.z);
+	}
+
+	static vec3 demodulate(const vec3& color, const vec3& albedo) {
+		const auto a = albedo_or_white(albedo);
+		return vec3(color.x / a.x, color.y / a.y, color.z / a.z);
+	}
+};
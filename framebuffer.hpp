@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "vec3.hpp"
+
+// Everything a pixel accumulates over the passes. All zero bytes is an
+// empty pixel, which is what fresh pages of a mapping hold.
+struct pixel_record {
+	vec3 color;
+	vec3 albedo;
+	vec3 normal;
+	float depth;
+	int samples;
+};
+
+// Frame buffer stored by row, j = 0 being the bottom row, in bands of
+// band_rows rows. It lives in anonymous memory, or with a path in a sparse
+// temporary file mapped shared, where pages only take up memory once
+// touched and the OS writes them back to the file. Bands of a file backed
+// frame are handed back as soon as they are rendered and again once read, so
+// resident memory stays bounded by what is being worked on, whatever the
+// resolution.
+struct framebuffer {
+
+	int width;
+	int height;
+	int band_rows;
+
+	pixel_record* pixels = nullptr;
+	size_t bytes = 0;
+	bool on_disk = false;
+
+	// Rows of each band not yet done in the current pass
+	std::unique_ptr<std::atomic<int>[]> rows_left;
+
+	framebuffer(int width, int height, int band_rows, const char* path = nullptr)
+		: width{width}, height{height}, band_rows{band_rows}, on_disk{path != nullptr} {
+		bytes = size_t(width) * height * sizeof(pixel_record);
+
+		void* memory = MAP_FAILED;
+		if (path) {
+			const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (fd >= 0) {
+				if (ftruncate(fd, bytes) == 0)
+					memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				close(fd);
+
+				// Scratch space only, the mapping keeps it alive until unmapped
+				unlink(path);
+			}
+		} else {
+			memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		}
+
+		if (memory != MAP_FAILED)
+			pixels = static_cast<pixel_record*>(memory);
+
+		const int bands = (height + band_rows - 1) / band_rows;
+		rows_left = std::make_unique<std::atomic<int>[]>(bands);
+		for (int b = 0; b < bands; b++)
+			rows_left[b] = band_size(b);
+	}
+
+	framebuffer(const framebuffer&) = delete;
+	framebuffer& operator=(const framebuffer&) = delete;
+
+	~framebuffer() {
+		if (pixels)
+			munmap(pixels, bytes);
+	}
+
+	bool ok() const {
+		return pixels != nullptr;
+	}
+
+	int band_size(int band) const {
+		return std::min(band_rows, height - band * band_rows);
+	}
+
+	pixel_record& operator()(int i, int j) {
+		return pixels[size_t(j) * width + i];
+	}
+
+	const pixel_record& operator()(int i, int j) const {
+		return pixels[size_t(j) * width + i];
+	}
+
+	// Tells the frame row j is done for this pass. May be called from any
+	// thread, once per row and pass; the call that completes a band starts
+	// writing it back and releases it.
+	void row_done(int j) {
+		const int band = j / band_rows;
+		if (--rows_left[band] > 0)
+			return;
+
+		rows_left[band] = band_size(band);
+		if (on_disk) {
+			const auto [begin, length] = pages(band);
+			msync(begin, length, MS_ASYNC);
+			madvise(begin, length, MADV_DONTNEED);
+		}
+	}
+
+	// Drops the band holding row j from memory, for a file backed frame.
+	// The data stays in the file, and comes back if the band is touched.
+	void release(int j) {
+		if (!on_disk)
+			return;
+
+		const auto [begin, length] = pages(j / band_rows);
+		madvise(begin, length, MADV_DONTNEED);
+	}
+
+	// Pages covering a band. The ones it shares with a neighbour go too,
+	// which is safe for a shared file mapping: the data stays in the page
+	// cache and a thread still writing the neighbour faults them back in.
+	std::pair<void*, size_t> pages(int band) const {
+		static const size_t page = sysconf(_SC_PAGESIZE);
+
+		const auto row_bytes = size_t(width) * sizeof(pixel_record);
+		const auto start = size_t(band) * band_rows * row_bytes;
+		const auto end = start + size_t(band_size(band)) * row_bytes;
+
+		const auto first = start / page * page;
+		const auto last = std::min((end + page - 1) / page * page, (bytes + page - 1) / page * page);
+		return {reinterpret_cast<std::byte*>(pixels) + first, last - first};
+	}
+};
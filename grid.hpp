@@ -0,0 +1,239 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "aabb.hpp"
+#include "ray.hpp"
+#include "vec3.hpp"
+
+// Uniform grid over the primitives of a scene, walked cell by cell along a
+// ray with the 3D-DDA of Amanatides and Woo, "A Fast Voxel Traversal
+// Algorithm for Ray Tracing". Scenes of many similar small objects fill it
+// evenly, where a median split BVH can be thrown off by a few huge ones.
+// Those, like the ground sphere of random_scene, would overlap every cell,
+// so primitives much larger than the typical one are kept in a separate
+// list that every ray tests first.
+//
+// Cells list the primitives whose boxes overlap them, all in one array with
+// an offset per cell.
+
+// Primitives spanning several cells are met again in each of them. The
+// mailbox remembers which ray each one was last tested against, so it is
+// tested only once.
+struct mailbox {
+	std::vector<uint32_t> stamps;
+	uint32_t ray = 0;
+
+	void start(size_t primitives) {
+		if (stamps.size() < primitives)
+			stamps.resize(primitives, 0);
+
+		if (++ray == 0) {
+			std::fill(stamps.begin(), stamps.end(), 0);
+			ray = 1;
+		}
+	}
+
+	// False if the primitive was already tested against this ray
+	bool first_visit(uint32_t primitive) {
+		if (stamps[primitive] == ray)
+			return false;
+		stamps[primitive] = ray;
+		return true;
+	}
+};
+
+// Rays get consecutive numbers within a thread, so one mailbox serves every
+// grid the thread walks
+inline mailbox& thread_mailbox() {
+	thread_local mailbox m;
+	return m;
+}
+
+struct uniform_grid {
+
+	// Cells per primitive, and the most cells along one axis
+	static constexpr real DENSITY = 2;
+	static constexpr int MAX_RESOLUTION = 128;
+
+	// Primitives whose box diagonal is this many times the median one go
+	// to the large list
+	static constexpr real LARGE_FACTOR = 32;
+
+	aabb bounds;
+	int resolution[3] = {0, 0, 0};
+	vec3 cell_size;
+
+	// Primitives of cell c are items[cell_start[c]] to items[cell_start[c + 1]]
+	std::vector<uint32_t> cell_start;
+	std::vector<uint32_t> items;
+	std::vector<uint32_t> large;
+
+	size_t primitives = 0;
+
+	uniform_grid() = default;
+
+	uniform_grid(const std::vector<aabb>& boxes) : primitives{boxes.size()} {
+		if (boxes.empty())
+			return;
+
+		std::vector<real> diagonals;
+		for (const auto& box : boxes)
+			diagonals.push_back((box.maximum - box.minimum).length());
+
+		auto sorted = diagonals;
+		std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+		const auto median = sorted[sorted.size() / 2];
+
+		std::vector<uint32_t> small;
+		for (uint32_t i = 0; i < boxes.size(); i++) {
+			if (boxes.size() > 1 && diagonals[i] > LARGE_FACTOR * median)
+				large.push_back(i);
+			else
+				small.push_back(i);
+		}
+
+		if (small.empty())
+			return;
+
+		bounds = boxes[small[0]];
+		for (const auto i : small)
+			bounds = surrounding_box(bounds, boxes[i]);
+
+		// Flat scenes still get a slab of cells
+		auto extent = bounds.maximum - bounds.minimum;
+		const auto padding = std::max({extent.x, extent.y, extent.z}) * real(1e-4) + real(1e-4);
+		bounds = aabb(bounds.minimum - vec3(padding, padding, padding), bounds.maximum + vec3(padding, padding, padding));
+		extent = bounds.maximum - bounds.minimum;
+
+		const auto per_unit = std::cbrt(DENSITY * small.size() / (extent.x * extent.y * extent.z));
+		for (int a = 0; a < 3; a++)
+			resolution[a] = std::clamp(int(std::round(extent[a] * per_unit)), 1, MAX_RESOLUTION);
+
+		cell_size = vec3(extent.x / resolution[0], extent.y / resolution[1], extent.z / resolution[2]);
+
+		// Counted first, then filled in
+		cell_start.assign(cells() + 1, 0);
+
+		const auto for_each_cell = [&](const aabb& box, auto&& f) {
+			int low[3], high[3];
+			for (int a = 0; a < 3; a++) {
+				low[a] = cell_of(box.minimum[a], a);
+				high[a] = cell_of(box.maximum[a], a);
+			}
+
+			for (int z = low[2]; z <= high[2]; z++)
+				for (int y = low[1]; y <= high[1]; y++)
+					for (int x = low[0]; x <= high[0]; x++)
+						f(index(x, y, z));
+		};
+
+		for (const auto i : small)
+			for_each_cell(boxes[i], [&](size_t c) { cell_start[c + 1]++; });
+
+		for (size_t c = 0; c < cells(); c++)
+			cell_start[c + 1] += cell_start[c];
+
+		items.resize(cell_start.back());
+		auto next = cell_start;
+		for (const auto i : small)
+			for_each_cell(boxes[i], [&](size_t c) { items[next[c]++] = i; });
+	}
+
+	size_t cells() const {
+		return size_t(resolution[0]) * resolution[1] * resolution[2];
+	}
+
+	bool empty() const {
+		return primitives == 0;
+	}
+
+	int cell_of(real coordinate, int axis) const {
+		return std::clamp(int((coordinate - bounds.minimum[axis]) / cell_size[axis]), 0, resolution[axis] - 1);
+	}
+
+	size_t index(int x, int y, int z) const {
+		return (size_t(z) * resolution[1] + y) * resolution[0] + x;
+	}
+
+	// Calls visit(begin, end) with the primitives of every cell the ray
+	// crosses between t_min and t_max, nearest first, until it returns true.
+	// t_max may shrink while walking, once it is inside the current cell
+	// the walk stops.
+	template<typename F>
+	void walk(const ray& r, real t_min, const real& t_max, F&& visit) const {
+		if (cell_start.empty())
+			return;
+
+		real enter = t_min;
+		real exit = t_max;
+
+		for (int a = 0; a < 3; a++) {
+			if (r.direction[a] == 0) {
+				if (r.origin[a] < bounds.minimum[a] || r.origin[a] > bounds.maximum[a])
+					return;
+				continue;
+			}
+
+			const auto inverse = 1 / r.direction[a];
+			auto t0 = (bounds.minimum[a] - r.origin[a]) * inverse;
+			auto t1 = (bounds.maximum[a] - r.origin[a]) * inverse;
+			if (t0 > t1)
+				std::swap(t0, t1);
+
+			enter = std::max(enter, t0);
+			exit = std::min(exit, t1);
+			if (exit < enter)
+				return;
+		}
+
+		const auto start = r.at(enter);
+
+		int cell[3], step[3], out[3];
+		real next[3], delta[3];
+
+		for (int a = 0; a < 3; a++) {
+			cell[a] = cell_of(start[a], a);
+
+			if (r.direction[a] > 0) {
+				step[a] = 1;
+				out[a] = resolution[a];
+				next[a] = (bounds.minimum[a] + (cell[a] + 1) * cell_size[a] - r.origin[a]) / r.direction[a];
+				delta[a] = cell_size[a] / r.direction[a];
+			} else if (r.direction[a] < 0) {
+				step[a] = -1;
+				out[a] = -1;
+				next[a] = (bounds.minimum[a] + cell[a] * cell_size[a] - r.origin[a]) / r.direction[a];
+				delta[a] = -cell_size[a] / r.direction[a];
+			} else {
+				step[a] = 0;
+				out[a] = -1;
+				next[a] = INFINITY;
+				delta[a] = INFINITY;
+			}
+		}
+
+		while (true) {
+			const auto c = index(cell[0], cell[1], cell[2]);
+			if (visit(items.data() + cell_start[c], items.data() + cell_start[c + 1]))
+				return;
+
+			const int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+
+			if (next[axis] > std::min(t_max, exit))
+				return;
+
+			cell[axis] += step[axis];
+			if (cell[axis] == out[axis])
+				return;
+			next[axis] += delta[axis];
+		}
+	}
+
+	size_t memory() const {
+		return (cell_start.size() + items.size() + large.size()) * sizeof(uint32_t);
+	}
+};
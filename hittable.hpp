@@ -1,28 +1,137 @@
 #pragma once
 
+#include <cstdint>
+#include <limits>
 #include <memory>
 
 #include "aabb.hpp"
 #include "ray.hpp"
 
 struct material;
+struct hittable;
+
+// Smallest parameter accepted as a hit. Rays leaving a surface start from an
+// origin pushed off it (see hit::spawn_ray), so this only has to exclude 0.
+constexpr real RAY_T_MIN = std::numeric_limits<real>::min();
 
 struct hit {
-	double parameter;
-	double u;
-	double v;
+	real parameter;
+	real u;
+	real v;
 	vec3 point;
 	vec3 normal;
+
+	// Bound on the absolute rounding error of `point`, set by primitives
+	// that compute it in a frame other than world space
+	vec3 point_error;
 	bool front_face;
 	std::shared_ptr<material> material_pointer;
 
+	// Position of the material in a static_scene's table, set only by it
+	uint32_t material_index;
+
+	// Primitive that was hit, whose complete_hit fills in the rest of the
+	// record. Null for objects that complete it during test_intersection.
+	const hittable* object;
+
+	// Ray cone at the hit, carried over to the rays leaving it, and the
+	// width it covers in uv space for filtered texture lookups
+	real cone_width = 0;
+	real cone_spread = 0;
+	real footprint = 0;
+
 	inline void face_determination(const ray& r, const vec3& out_normal) {
 		front_face = dot(r.direction, out_normal) < 0;
 		normal = front_face ? out_normal : -out_normal;
 	}
+
+	// `extent` is the world space length covered by one unit of uv
+	inline void footprint_determination(const ray& r, real extent) {
+		cone_width = r.width + r.spread * parameter * r.direction.length();
+		cone_spread = r.spread;
+		footprint = cone_width / extent;
+	}
+
+	// Ray leaving the surface towards `direction`. Its origin is moved off
+	// the surface, to the side `direction` points to, by a bound on the
+	// rounding error of the hit point. Primitives keep that error small by
+	// reprojecting the point onto their surface.
+	ray spawn_ray(const vec3& direction, real time) const {
+		const auto error = point_error + gamma_bound<real>(5) * vec3_abs(point);
+		const auto distance = 2 * dot(vec3_abs(normal), error);
+
+		const auto offset = distance * normal;
+		const auto origin = dot(direction, normal) > 0 ? point + offset : point - offset;
+
+		ray spawned(origin, direction, time);
+		spawned.width = cone_width;
+		spawned.spread = cone_spread;
+
+		return spawned;
+	}
 };
 
+// Intersection runs in two phases. test_intersection finds the closest hit
+// but only records its parameter and object, and complete_hit then computes
+// the point, normal, uv and material once, for the hit that was kept.
+// test_hit does both. Every phase leaves the record untouched on a miss.
 struct hittable {
-	virtual bool test_hit(const ray& r, double t_min, double t_max, hit& info) const = 0;
-	virtual bool bounding_box(double t_min, double t_max, aabb& output_box) const = 0;
+	virtual bool test_hit(const ray& r, real t_min, real t_max, hit& info) const = 0;
+	virtual bool bounding_box(real t_min, real t_max, aabb& output_box) const = 0;
+
+	// Objects without a split fall back on a complete test_hit
+	virtual bool test_intersection(const ray& r, real t_min, real t_max, hit& info) const {
+		if (!test_hit(r, t_min, t_max, info))
+			return false;
+
+		info.object = nullptr;
+		return true;
+	}
+
+	virtual void complete_hit(const ray& r, hit& info) const {}
+
+	// Surfaces that can be sampled as area lights, see light_tree. The
+	// bounds are the area and a cone around every normal of the surface.
+	virtual bool emitter_bounds(real& area, vec3& axis, real& cos_theta) const {
+		return false;
+	}
+
+	virtual std::shared_ptr<material> surface_material() const {
+		return nullptr;
+	}
+
+	// Direction from `origin` towards a point of the surface picked with
+	// the uniform numbers u1 and u2
+	virtual bool sample_direction(const vec3& origin, real time, real u1, real u2, vec3& direction) const {
+		return false;
+	}
+
+	// Velocity the surface moves with, for motion vectors
+	virtual vec3 motion() const {
+		return vec3(0, 0, 0);
+	}
+
+	// Point of the surface picked uniformly by area with u1 and u2, and the
+	// outward normal there
+	virtual bool sample_point(real time, real u1, real u2, vec3& point, vec3& normal) const {
+		return false;
+	}
+
+	// Solid angle density of sample_direction for the ray `r`, which hits
+	// this surface at `info`
+	virtual real direction_pdf(const ray& r, const hit& info) const {
+		return 0;
+	}
+
+	// Whether anything is hit in (t_min, t_max). Returns on the first hit
+	// found, without looking for the closest one or filling a hit record.
+	virtual bool test_occluded(const ray& r, real t_min, real t_max) const {
+		hit info;
+		return test_hit(r, t_min, t_max, info);
+	}
 };
+
+inline void finish_hit(const ray& r, hit& info) {
+	if (info.object)
+		info.object->complete_hit(r, info);
+}
@@ -11,23 +11,37 @@ struct hittable_list : hittable {
 	hittable_list() = default;
 	hittable_list(std::vector<std::shared_ptr<hittable>> objects) : objects{std::move(objects)} {}
 
-	virtual bool test_hit(const ray& r, double t_min, double t_max, hit& info) const override {
-		hit tmp_info;
+	virtual bool test_hit(const ray& r, real t_min, real t_max, hit& info) const override {
+		if (!test_intersection(r, t_min, t_max, info))
+			return false;
+
+		finish_hit(r, info);
+		return true;
+	}
+
+	virtual bool test_intersection(const ray& r, real t_min, real t_max, hit& info) const override {
 		bool hit_anything = false;
 		auto closest_so_far = t_max;
 
 		for (const auto& object : objects) {
-			if (object->test_hit(r, t_min, closest_so_far, tmp_info)) {
+			if (object->test_intersection(r, t_min, closest_so_far, info)) {
 				hit_anything = true;
-				closest_so_far = tmp_info.parameter;
-				info = tmp_info;
+				closest_so_far = info.parameter;
 			}
 		}
 
 		return hit_anything;
 	}
 
-	virtual bool bounding_box(double t_min, double t_max, aabb& output_box) const override {
+	virtual bool test_occluded(const ray& r, real t_min, real t_max) const override {
+		for (const auto& object : objects)
+			if (object->test_occluded(r, t_min, t_max))
+				return true;
+
+		return false;
+	}
+
+	virtual bool bounding_box(real t_min, real t_max, aabb& output_box) const override {
 		if (objects.empty())
 			return false;
 		
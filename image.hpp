@@ -1,6 +1,11 @@
 #pragma once
 
+#include <cstdint>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
 
 #include "vec3.hpp"
 
@@ -14,10 +19,102 @@ inline uint8_t color_clamp(int x) {
 	return x;
 }
 
-void write_color(const std::ostream& out, const vec3& color, int samples) {
+void write_color(std::ostream& out, const vec3& color, int samples) {
+	if (samples == 0) {
+		out << uint8_t(0) << uint8_t(0) << uint8_t(0);
+		return;
+	}
+
 	uint8_t r = color_clamp(255 * std::sqrt(color.x / samples));
 	uint8_t g = color_clamp(255 * std::sqrt(color.y / samples));
 	uint8_t b = color_clamp(255 * std::sqrt(color.z / samples));
 
-	std::cout << r << g << b;
+	out << r << g << b;
+}
+
+// Reads a binary (P6) or plain (P3) PPM into 8 bit RGB triples, top row
+// first. Returns false if the file is missing or not a PPM.
+inline bool read_ppm(const char* path, int& width, int& height, std::vector<uint8_t>& rgb) {
+	std::ifstream in(path, std::ios::binary);
+
+	// Header fields are separated by whitespace and may be followed by comments
+	const auto next_field = [&](int& value) {
+		while (in >> std::ws && in.peek() == '#')
+			in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+		return bool(in >> value);
+	};
+
+	std::string magic;
+	int max_value;
+	if (!(in >> magic) || (magic != "P6" && magic != "P3"))
+		return false;
+	if (!next_field(width) || !next_field(height) || !next_field(max_value))
+		return false;
+	if (width <= 0 || height <= 0 || max_value <= 0 || max_value > 255)
+		return false;
+
+	rgb.resize(size_t(width) * height * 3);
+
+	if (magic == "P6") {
+		in.get();
+		in.read(reinterpret_cast<char*>(rgb.data()), rgb.size());
+	} else {
+		for (auto& c : rgb) {
+			int value;
+			in >> value;
+			c = value;
+		}
+	}
+
+	if (!in)
+		return false;
+
+	if (max_value != 255)
+		for (auto& c : rgb)
+			c = c * 255 / max_value;
+
+	return true;
+}
+
+// Writes linear RGB as a little endian PFM. Pixels are rows of `width`,
+// top row first, PFM itself stores them bottom up.
+inline bool write_pfm(const char* path, int width, int height, const std::vector<vec3>& pixels) {
+	std::ofstream out(path, std::ios::binary);
+	out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+
+	std::vector<float> row(size_t(width) * 3);
+	for (int y = height - 1; y >= 0; --y) {
+		for (int x = 0; x < width; ++x) {
+			const auto& p = pixels[size_t(y) * width + x];
+			row[3 * x + 0] = p.x;
+			row[3 * x + 1] = p.y;
+			row[3 * x + 2] = p.z;
+		}
+		out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+	}
+
+	return bool(out);
+}
+
+// Reads a color PFM written by write_pfm or any other little endian writer
+inline bool read_pfm(const char* path, int& width, int& height, std::vector<vec3>& pixels) {
+	std::ifstream in(path, std::ios::binary);
+
+	std::string magic;
+	double scale;
+	if (!(in >> magic >> width >> height >> scale) || magic != "PF" || scale >= 0 || width <= 0 || height <= 0)
+		return false;
+	in.get();
+
+	pixels.resize(size_t(width) * height);
+	std::vector<float> row(size_t(width) * 3);
+	for (int y = height - 1; y >= 0; --y) {
+		if (!in.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float)))
+			return false;
+
+		for (int x = 0; x < width; ++x)
+			pixels[size_t(y) * width + x] = vec3(row[3 * x + 0], row[3 * x + 1], row[3 * x + 2]);
+	}
+
+	return true;
 }
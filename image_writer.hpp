@@ -0,0 +1,399 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "deflate.hpp"
+#include "image.hpp"
+#include "timeline.hpp"
+#include "vec3.hpp"
+
+// Writes the final image as an 8 bit PNG, a half float EXR or a PFM. PNG
+// and EXR are encoded in blocks of rows, each compressed on its own, so a
+// block can be done by whichever thread finishes its last row while the
+// rest of the frame is still rendering. Whatever is left is encoded by all
+// threads when the file is written.
+
+enum class image_format {
+	ppm,
+	png,
+	exr,
+	pfm,
+};
+
+// How PNG maps radiance to [0, 1] before gamma. Clamping matches the PPM
+// output, Reinhard's curve keeps some detail in highlights.
+enum class tone_curve {
+	clamp,
+	reinhard,
+};
+
+// Scanlines per block of ZIP compressed EXR, fixed by the format
+constexpr int EXR_BLOCK_ROWS = 16;
+
+constexpr int PNG_BLOCK_ROWS = 16;
+
+inline uint8_t tone_map(real c, tone_curve curve) {
+	if (curve == tone_curve::reinhard)
+		c = c / (1 + c);
+	return color_clamp(255 * std::sqrt(c));
+}
+
+inline uint16_t float_to_half(float value) {
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+
+	const uint16_t sign = (bits >> 16) & 0x8000;
+	const int exponent = (bits >> 23) & 0xff;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (exponent == 0xff)
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+	const int e = exponent - 127 + 15;
+	if (e >= 31)
+		return sign | 0x7c00;
+
+	// Subnormal halves, rounded to nearest
+	if (e <= 0) {
+		if (e < -10)
+			return sign;
+		mantissa |= 0x800000;
+		const int shift = 14 - e;
+		uint16_t half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+			half++;
+		return sign | half;
+	}
+
+	// A carry out of the mantissa correctly bumps the exponent
+	uint16_t half = sign | (e << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000)
+		half++;
+	return half;
+}
+
+inline void put_little_endian(std::vector<uint8_t>& out, uint64_t value, int bytes) {
+	for (int k = 0; k < bytes; k++)
+		out.push_back(value >> (8 * k));
+}
+
+struct image_writer {
+
+	// Mean radiance of a pixel, y = 0 being the top row
+	using pixel_source = std::function<vec3(int x, int y)>;
+
+	image_format format;
+	int width;
+	int height;
+	pixel_source pixel;
+	tone_curve curve;
+
+	int block_rows;
+	int block_count;
+
+	// Encoded blocks, and for PNG the checksum and size of what went in
+	std::vector<std::vector<uint8_t>> blocks;
+	std::vector<uint32_t> checksums;
+	std::vector<size_t> raw_sizes;
+
+	std::unique_ptr<std::atomic<int>[]> rows_left;
+	std::unique_ptr<std::atomic<bool>[]> encoded;
+
+	image_writer(image_format format, int width, int height, pixel_source pixel, tone_curve curve = tone_curve::clamp)
+		: format{format}, width{width}, height{height}, pixel{pixel}, curve{curve} {
+		block_rows = format == image_format::exr ? EXR_BLOCK_ROWS : PNG_BLOCK_ROWS;
+		block_count = (height + block_rows - 1) / block_rows;
+
+		blocks.resize(block_count);
+		checksums.resize(block_count);
+		raw_sizes.resize(block_count);
+
+		rows_left = std::make_unique<std::atomic<int>[]>(block_count);
+		encoded = std::make_unique<std::atomic<bool>[]>(block_count);
+		for (int k = 0; k < block_count; k++) {
+			rows_left[k] = std::min(block_rows, height - k * block_rows);
+			encoded[k] = false;
+		}
+	}
+
+	// Only PNG and EXR are written in blocks
+	bool streams() const {
+		return format == image_format::png || format == image_format::exr;
+	}
+
+	// Tells the writer row y won't change anymore. May be called from any
+	// thread, once per row; the call that completes a block encodes it.
+	void row_done(int y) {
+		if (!streams())
+			return;
+
+		const int k = y / block_rows;
+		if (--rows_left[k] == 0)
+			encode(k);
+	}
+
+	void encode(int k) {
+		if (encoded[k].exchange(true))
+			return;
+
+		timeline_scope scope("output", "encode_block", "block", k);
+
+		if (format == image_format::png)
+			encode_png(k);
+		else
+			encode_exr(k);
+	}
+
+	bool write(const char* path) {
+		if (streams()) {
+			#pragma omp parallel for schedule(dynamic)
+			for (int k = 0; k < block_count; k++)
+				encode(k);
+		}
+
+		std::ofstream out(path, std::ios::binary);
+
+		switch (format) {
+		case image_format::png:
+			write_png(out);
+			break;
+		case image_format::exr:
+			write_exr(out);
+			break;
+		default:
+			return write_pfm(path);
+		}
+
+		return bool(out);
+	}
+
+	void rgb8_row(int y, uint8_t* row) const {
+		for (int x = 0; x < width; x++) {
+			const auto color = pixel(x, y);
+			row[3 * x + 0] = tone_map(color.x, curve);
+			row[3 * x + 1] = tone_map(color.y, curve);
+			row[3 * x + 2] = tone_map(color.z, curve);
+		}
+	}
+
+	// Each row gets the filter with the smallest sum of absolute values.
+	// The first row of a block only gets the ones that don't look at the
+	// row above, which may belong to a block that isn't rendered yet.
+	void encode_png(int k) {
+		const int first = k * block_rows;
+		const int last = std::min(height, first + block_rows);
+		const size_t stride = size_t(width) * 3;
+
+		std::vector<uint8_t> raw;
+		raw.reserve((stride + 1) * (last - first));
+
+		std::vector<uint8_t> above(stride, 0), current(stride);
+		std::vector<uint8_t> candidate(stride), best(stride);
+
+		for (int y = first; y < last; y++) {
+			rgb8_row(y, current.data());
+
+			const int filters = y == first ? 2 : 5;
+			int best_filter = 0;
+			uint64_t best_cost = UINT64_MAX;
+
+			for (int filter = 0; filter < filters; filter++) {
+				uint64_t cost = 0;
+				for (size_t i = 0; i < stride; i++) {
+					const int a = i >= 3 ? current[i - 3] : 0;
+					const int b = above[i];
+					const int c = i >= 3 ? above[i - 3] : 0;
+
+					int predicted = 0;
+					switch (filter) {
+					case 1: predicted = a; break;
+					case 2: predicted = b; break;
+					case 3: predicted = (a + b) / 2; break;
+					case 4: {
+						const int p = a + b - c;
+						const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+						predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+						break;
+					}
+					}
+
+					candidate[i] = current[i] - predicted;
+					cost += std::abs(int8_t(candidate[i]));
+				}
+
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_filter = filter;
+					best.swap(candidate);
+				}
+			}
+
+			raw.push_back(best_filter);
+			raw.insert(raw.end(), best.begin(), best.end());
+			above.swap(current);
+		}
+
+		deflate_piece(raw.data(), raw.size(), k == block_count - 1, blocks[k]);
+		checksums[k] = adler32(raw.data(), raw.size());
+		raw_sizes[k] = raw.size();
+	}
+
+	// Scanlines hold each channel in turn, alphabetically, as halves. Before
+	// compression the bytes are split into even and odd halves and delta
+	// coded, as OpenEXR's ZIP compression expects.
+	void encode_exr(int k) {
+		const int first = k * block_rows;
+		const int last = std::min(height, first + block_rows);
+
+		std::vector<uint8_t> raw;
+		raw.reserve(size_t(width) * 6 * (last - first));
+
+		std::vector<vec3> row(width);
+		for (int y = first; y < last; y++) {
+			for (int x = 0; x < width; x++)
+				row[x] = pixel(x, y);
+
+			for (int channel = 2; channel >= 0; channel--)
+				for (int x = 0; x < width; x++)
+					put_little_endian(raw, float_to_half(row[x][channel]), 2);
+		}
+
+		std::vector<uint8_t> split(raw.size());
+		const size_t half = (raw.size() + 1) / 2;
+		for (size_t i = 0; i < raw.size(); i++)
+			split[i % 2 ? half + i / 2 : i / 2] = raw[i];
+
+		for (size_t i = split.size() - 1; i > 0; i--)
+			split[i] = uint8_t(split[i] - split[i - 1] + 128);
+
+		auto compressed = zlib_compress(split.data(), split.size());
+
+		// Readers take a block as uncompressed when it isn't any smaller
+		blocks[k] = compressed.size() < raw.size() ? std::move(compressed) : std::move(raw);
+	}
+
+	static void write_chunk(std::ostream& out, const char* type, const std::vector<uint8_t>& data) {
+		std::vector<uint8_t> length;
+		put_big_endian(length, data.size());
+
+		uint32_t crc = crc32(reinterpret_cast<const uint8_t*>(type), 4);
+		crc = crc32(data.data(), data.size(), crc);
+
+		std::vector<uint8_t> trailer;
+		put_big_endian(trailer, crc);
+
+		out.write(reinterpret_cast<const char*>(length.data()), 4);
+		out.write(type, 4);
+		out.write(reinterpret_cast<const char*>(data.data()), data.size());
+		out.write(reinterpret_cast<const char*>(trailer.data()), 4);
+	}
+
+	// Every block goes in its own IDAT chunk, the zlib header in the first
+	// one and the checksum of the whole stream in the last
+	void write_png(std::ostream& out) {
+		const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+		out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+		std::vector<uint8_t> header;
+		put_big_endian(header, width);
+		put_big_endian(header, height);
+		header.insert(header.end(), {8, 2, 0, 0, 0});
+		write_chunk(out, "IHDR", header);
+
+		uint32_t adler = 1;
+		for (int k = 0; k < block_count; k++) {
+			adler = adler32_combine(adler, checksums[k], raw_sizes[k]);
+
+			if (k > 0 && k < block_count - 1) {
+				write_chunk(out, "IDAT", blocks[k]);
+				continue;
+			}
+
+			std::vector<uint8_t> data;
+			if (k == 0)
+				data = {0x78, 0x01};
+			data.insert(data.end(), blocks[k].begin(), blocks[k].end());
+			if (k == block_count - 1)
+				put_big_endian(data, adler);
+
+			write_chunk(out, "IDAT", data);
+		}
+
+		write_chunk(out, "IEND", {});
+	}
+
+	void write_exr(std::ostream& out) {
+		std::vector<uint8_t> header = {0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};
+
+		const auto attribute = [&](const char* name, const char* type, const std::vector<uint8_t>& value) {
+			header.insert(header.end(), name, name + std::strlen(name) + 1);
+			header.insert(header.end(), type, type + std::strlen(type) + 1);
+			put_little_endian(header, value.size(), 4);
+			header.insert(header.end(), value.begin(), value.end());
+		};
+
+		std::vector<uint8_t> channels;
+		for (const char* name : {"B", "G", "R"}) {
+			channels.insert(channels.end(), name, name + 2);
+			put_little_endian(channels, 1, 4); // half
+			put_little_endian(channels, 0, 4); // linear flag and reserved bytes
+			put_little_endian(channels, 1, 4);
+			put_little_endian(channels, 1, 4);
+		}
+		channels.push_back(0);
+
+		std::vector<uint8_t> window;
+		for (const int value : {0, 0, width - 1, height - 1})
+			put_little_endian(window, value, 4);
+
+		const auto float_bytes = [](float value) {
+			uint32_t bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+			std::vector<uint8_t> bytes;
+			put_little_endian(bytes, bits, 4);
+			return bytes;
+		};
+
+		attribute("channels", "chlist", channels);
+		attribute("compression", "compression", {3}); // ZIP, 16 scanlines
+		attribute("dataWindow", "box2i", window);
+		attribute("displayWindow", "box2i", window);
+		attribute("lineOrder", "lineOrder", {0}); // increasing y
+		attribute("pixelAspectRatio", "float", float_bytes(1));
+		attribute("screenWindowCenter", "v2f", {0, 0, 0, 0, 0, 0, 0, 0});
+		attribute("screenWindowWidth", "float", float_bytes(1));
+		header.push_back(0);
+
+		uint64_t offset = header.size() + 8 * size_t(block_count);
+		for (int k = 0; k < block_count; k++) {
+			put_little_endian(header, offset, 8);
+			offset += 8 + blocks[k].size();
+		}
+
+		out.write(reinterpret_cast<const char*>(header.data()), header.size());
+
+		for (int k = 0; k < block_count; k++) {
+			std::vector<uint8_t> prefix;
+			put_little_endian(prefix, k * block_rows, 4);
+			put_little_endian(prefix, blocks[k].size(), 4);
+			out.write(reinterpret_cast<const char*>(prefix.data()), prefix.size());
+			out.write(reinterpret_cast<const char*>(blocks[k].data()), blocks[k].size());
+		}
+	}
+
+	bool write_pfm(const char* path) const {
+		std::vector<vec3> pixels(size_t(width) * height);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				pixels[size_t(y) * width + x] = pixel(x, y);
+
+		return ::write_pfm(path, width, height, pixels);
+	}
+};
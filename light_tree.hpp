@@ -0,0 +1,384 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "aabb.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "material.hpp"
+#include "vec3.hpp"
+
+// Picks which emitter to sample from a shading point. Emitters are grouped
+// in a BVH whose nodes bound the position, power and emission directions of
+// everything below them, following Conty Estevez and Kulla, "Importance
+// Sampling of Many Lights with Adaptive Tree Splitting", as done in pbrt-v4.
+// Sampling walks down from the root choosing children by their estimated
+// contribution, so it costs a log of the number of emitters.
+
+enum class light_selection {
+	uniform,
+	tree,
+};
+
+inline real safe_sqrt(real x) {
+	return std::sqrt(std::max(x, real(0)));
+}
+
+// Cone of directions around `axis`, cos_theta = -1 covers every direction
+struct direction_cone {
+	vec3 axis;
+	real cos_theta;
+};
+
+// Rotates v around the unit vector `axis`
+inline vec3 rotate(const vec3& v, const vec3& axis, real angle) {
+	const auto c = std::cos(angle);
+	const auto s = std::sin(angle);
+	return c * v + s * cross(axis, v) + (1 - c) * dot(axis, v) * axis;
+}
+
+inline direction_cone cone_union(const direction_cone& a, const direction_cone& b) {
+	const direction_cone everything{vec3(0, 0, 1), -1};
+
+	const auto theta_a = std::acos(std::clamp(a.cos_theta, real(-1), real(1)));
+	const auto theta_b = std::acos(std::clamp(b.cos_theta, real(-1), real(1)));
+	const auto theta_d = std::acos(std::clamp(dot(a.axis, b.axis), real(-1), real(1)));
+
+	if (std::min(theta_d + theta_b, PI) <= theta_a)
+		return a;
+	if (std::min(theta_d + theta_a, PI) <= theta_b)
+		return b;
+
+	const auto theta_o = (theta_a + theta_d + theta_b) / 2;
+	if (theta_o >= PI)
+		return everything;
+
+	const auto normal = cross(a.axis, b.axis);
+	if (normal.length_squared() == 0)
+		return everything;
+
+	return {rotate(a.axis, unit_vector(normal), theta_o - theta_a), std::cos(theta_o)};
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines
+inline real cos_sub_clamped(real sin_a, real cos_a, real sin_b, real cos_b) {
+	return cos_a > cos_b ? 1 : cos_a * cos_b + sin_a * sin_b;
+}
+
+inline real sin_sub_clamped(real sin_a, real cos_a, real sin_b, real cos_b) {
+	return cos_a > cos_b ? 0 : sin_a * cos_b - cos_a * sin_b;
+}
+
+struct light_bounds {
+	aabb box;
+	real power;
+
+	// Normals lie within cos_theta_o of the axis and light leaves them
+	// within cos_theta_e, a right angle for diffuse emitters
+	direction_cone normals;
+	real cos_theta_e;
+	bool two_sided;
+
+	vec3 centroid() const {
+		return 0.5 * (box.minimum + box.maximum);
+	}
+
+	// Conservative estimate of the light reaching `p`, on a surface with
+	// normal `n`, from everything inside the bounds
+	real importance(const vec3& p, const vec3& n) const {
+		const auto center = centroid();
+		const auto half_diagonal = (box.maximum - box.minimum).length() / 2;
+		const auto distance_squared = std::max((p - center).length_squared(), half_diagonal * half_diagonal);
+
+		const auto to_p = unit_vector(p - center);
+		auto cos_theta_w = dot(normals.axis, to_p);
+		if (two_sided)
+			cos_theta_w = std::fabs(cos_theta_w);
+		const auto sin_theta_w = safe_sqrt(1 - cos_theta_w * cos_theta_w);
+
+		// Half angle subtended by the bounds from p, all of them when inside
+		const auto cos_theta_b = (p - center).length_squared() <= half_diagonal * half_diagonal
+			? real(-1) : safe_sqrt(1 - half_diagonal * half_diagonal / (p - center).length_squared());
+		const auto sin_theta_b = safe_sqrt(1 - cos_theta_b * cos_theta_b);
+
+		const auto cos_theta_o = normals.cos_theta;
+		const auto sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+
+		const auto cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+		const auto sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+		const auto cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+
+		if (cos_theta_p <= cos_theta_e)
+			return 0;
+
+		auto importance = power * cos_theta_p / distance_squared;
+
+		const auto cos_theta_i = std::fabs(dot(to_p, n));
+		const auto sin_theta_i = safe_sqrt(1 - cos_theta_i * cos_theta_i);
+		importance *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+
+		return std::max(importance, real(0));
+	}
+};
+
+inline light_bounds bounds_union(const light_bounds& a, const light_bounds& b) {
+	if (a.power == 0)
+		return b;
+	if (b.power == 0)
+		return a;
+
+	return {
+		surrounding_box(a.box, b.box),
+		a.power + b.power,
+		cone_union(a.normals, b.normals),
+		std::min(a.cos_theta_e, b.cos_theta_e),
+		a.two_sided || b.two_sided,
+	};
+}
+
+struct light_tree {
+
+	static constexpr int BUCKETS = 12;
+
+	struct emitter {
+		const hittable* object;
+		light_bounds bounds;
+
+		// Branches from the root down to its leaf, one bit per level
+		uint64_t trail;
+	};
+
+	// Flattened in depth first order, an inner node's first child is right
+	// after it and `offset` is its second child. Leaves hold one emitter.
+	struct node {
+		light_bounds bounds;
+		uint32_t offset;
+		bool leaf;
+	};
+
+	light_selection selection;
+	std::vector<emitter> emitters;
+	std::vector<node> nodes;
+	std::unordered_map<const hittable*, uint32_t> indices;
+
+	// Collects every object with a bounded surface and a material that
+	// emits light, rated by the emission at the middle of its texture
+	light_tree(const hittable_list& list, real t_min, real t_max, light_selection selection = light_selection::tree)
+	    : selection{selection} {
+		for (const auto& object : list.objects) {
+			real area;
+			direction_cone normals;
+			const auto m = object->surface_material();
+
+			aabb box;
+			if (!m || !object->emitter_bounds(area, normals.axis, normals.cos_theta) || !object->bounding_box(t_min, t_max, box))
+				continue;
+
+			const auto center = 0.5 * (box.minimum + box.maximum);
+			const auto radiance = m->emitted(0.5, 0.5, center);
+			const auto luminance = real(0.2126) * radiance.x + real(0.7152) * radiance.y + real(0.0722) * radiance.z;
+			if (luminance <= 0)
+				continue;
+
+			// Emission leaves both sides of every surface
+			const light_bounds bounds{box, 2 * PI * area * luminance, normals, 0, true};
+			emitters.push_back({object.get(), bounds, 0});
+		}
+
+		if (emitters.empty())
+			return;
+
+		std::vector<uint32_t> order(emitters.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = i;
+
+		build(order, 0, order.size(), 0, 0);
+
+		for (size_t i = 0; i < emitters.size(); i++)
+			indices[emitters[i].object] = i;
+	}
+
+	bool empty() const {
+		return emitters.empty();
+	}
+
+	// Solid angle of the directions around the normals that light reaches,
+	// weighted by cosine, the orientation term of the split cost
+	static real orientation_measure(const light_bounds& b) {
+		const auto theta_o = std::acos(std::clamp(b.normals.cos_theta, real(-1), real(1)));
+		const auto theta_e = std::acos(std::clamp(b.cos_theta_e, real(-1), real(1)));
+		const auto theta_w = std::min(theta_o + theta_e, PI);
+		const auto sin_theta_o = std::sin(theta_o);
+
+		return 2 * PI * (1 - std::cos(theta_o))
+		     + PI / 2 * (2 * theta_w * sin_theta_o - std::cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_theta_o + std::cos(theta_o));
+	}
+
+	static real surface_area(const aabb& box) {
+		const auto d = box.maximum - box.minimum;
+		return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	// Surface area orientation heuristic, Kr favours cuts across the
+	// longest side of the parent
+	static real split_cost(const light_bounds& b, const aabb& parent, int axis) {
+		const auto extent = parent.maximum - parent.minimum;
+		const auto longest = std::max({extent.x, extent.y, extent.z});
+		const auto kr = extent[axis] > 0 ? longest / extent[axis] : 1;
+
+		return b.power * orientation_measure(b) * kr * std::max(surface_area(b.box), real(1e-12));
+	}
+
+	uint32_t build(std::vector<uint32_t>& order, size_t start, size_t end, uint64_t trail, int depth) {
+		const uint32_t index = nodes.size();
+		nodes.emplace_back();
+
+		if (end - start == 1) {
+			auto& e = emitters[order[start]];
+			e.trail = trail;
+			nodes[index] = {e.bounds, order[start], true};
+			return index;
+		}
+
+		light_bounds bounds = emitters[order[start]].bounds;
+		aabb centroids(bounds.centroid(), bounds.centroid());
+		for (size_t i = start + 1; i < end; i++) {
+			const auto& b = emitters[order[i]].bounds;
+			bounds = bounds_union(bounds, b);
+			centroids = surrounding_box(centroids, aabb(b.centroid(), b.centroid()));
+		}
+
+		int best_axis = -1;
+		int best_bucket = 0;
+		real best_cost = INFINITY;
+
+		for (int axis = 0; axis < 3; axis++) {
+			const auto low = centroids.minimum[axis];
+			const auto width = centroids.maximum[axis] - low;
+			if (width <= 0)
+				continue;
+
+			light_bounds buckets[BUCKETS] = {};
+			for (size_t i = start; i < end; i++) {
+				const auto& b = emitters[order[i]].bounds;
+				const int k = std::min(int(BUCKETS * (b.centroid()[axis] - low) / width), BUCKETS - 1);
+				buckets[k] = bounds_union(buckets[k], b);
+			}
+
+			for (int split = 0; split < BUCKETS - 1; split++) {
+				light_bounds below = {}, above = {};
+				for (int k = 0; k <= split; k++)
+					below = bounds_union(below, buckets[k]);
+				for (int k = split + 1; k < BUCKETS; k++)
+					above = bounds_union(above, buckets[k]);
+
+				const auto cost = split_cost(below, bounds.box, axis) + split_cost(above, bounds.box, axis);
+				if (below.power > 0 && above.power > 0 && cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_bucket = split;
+				}
+			}
+		}
+
+		size_t mid = (start + end) / 2;
+		if (best_axis >= 0) {
+			const auto low = centroids.minimum[best_axis];
+			const auto width = centroids.maximum[best_axis] - low;
+
+			const auto it = std::partition(order.begin() + start, order.begin() + end, [&](uint32_t i) {
+				const auto c = emitters[i].bounds.centroid()[best_axis];
+				return std::min(int(BUCKETS * (c - low) / width), BUCKETS - 1) <= best_bucket;
+			});
+			mid = it - order.begin();
+		}
+
+		// Past 32 levels splits are balanced, so no trail needs more than 64 bits
+		if (mid == start || mid == end || depth >= 32)
+			mid = (start + end) / 2;
+
+		build(order, start, mid, trail, depth + 1);
+		const auto second = build(order, mid, end, trail | uint64_t(1) << depth, depth + 1);
+
+		nodes[index] = {bounds, second, false};
+		return index;
+	}
+
+	// Emitter to sample from point p with normal n, and the probability it
+	// had of being picked. Returns null when nothing can reach p.
+	const hittable* sample(const vec3& p, const vec3& n, real u, real& pmf) const {
+		if (emitters.empty())
+			return nullptr;
+
+		if (selection == light_selection::uniform) {
+			pmf = real(1) / emitters.size();
+			return emitters[std::min(size_t(u * emitters.size()), emitters.size() - 1)].object;
+		}
+
+		pmf = 1;
+		uint32_t current = 0;
+
+		while (true) {
+			const node& here = nodes[current];
+
+			if (here.leaf)
+				return current > 0 || here.bounds.importance(p, n) > 0 ? emitters[here.offset].object : nullptr;
+
+			const real first = nodes[current + 1].bounds.importance(p, n);
+			const real second = nodes[here.offset].bounds.importance(p, n);
+			if (first == 0 && second == 0)
+				return nullptr;
+
+			const auto p_first = first / (first + second);
+			if (u < p_first) {
+				u = std::min(u / p_first, real(0.99999994));
+				pmf *= p_first;
+				current = current + 1;
+			} else {
+				u = std::min((u - p_first) / (1 - p_first), real(0.99999994));
+				pmf *= 1 - p_first;
+				current = here.offset;
+			}
+		}
+	}
+
+	// Probability of sample picking `object` from p with normal n
+	real pmf(const vec3& p, const vec3& n, const hittable* object) const {
+		const auto found = indices.find(object);
+		if (found == indices.end())
+			return 0;
+
+		if (selection == light_selection::uniform)
+			return real(1) / emitters.size();
+
+		if (nodes[0].leaf)
+			return nodes[0].bounds.importance(p, n) > 0 ? 1 : 0;
+
+		const auto trail = emitters[found->second].trail;
+		real pmf = 1;
+		uint32_t current = 0;
+
+		for (int depth = 0; !nodes[current].leaf; depth++) {
+			const node& here = nodes[current];
+			const real first = nodes[current + 1].bounds.importance(p, n);
+			const real second = nodes[here.offset].bounds.importance(p, n);
+			if (first == 0 && second == 0)
+				return 0;
+
+			if (trail >> depth & 1) {
+				pmf *= second / (first + second);
+				current = here.offset;
+			} else {
+				pmf *= first / (first + second);
+				current = current + 1;
+			}
+		}
+
+		return pmf;
+	}
+};
@@ -1,17 +1,33 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <random>
+#include <vector>
 
+#include <omp.h>
+
+#include "arena.hpp"
 #include "bvh_node.hpp"
 #include "vec3.hpp"
 #include "image.hpp"
+#include "image_writer.hpp"
 #include "ray.hpp"
-#include "sphere.hpp"
 #include "hittable_list.hpp"
+#include "light_tree.hpp"
+#include "numa.hpp"
+#include "path_guiding.hpp"
+#include "photon_map.hpp"
 #include "camera.hpp"
 #include "utils.hpp"
-#include "material.hpp"
-#include "rectangles.hpp"
+#include "denoiser.hpp"
+#include "framebuffer.hpp"
+#include "sampler.hpp"
+#include "render.hpp"
+#include "scenes.hpp"
+#include "static_scene.hpp"
+#include "timeline.hpp"
 
 constexpr double ASPECT_RATIO = (double)1;
 constexpr int WIDTH = 200;
@@ -20,196 +36,460 @@ constexpr int HEIGHT = WIDTH / ASPECT_RATIO;
 constexpr int SAMPLES = 500;
 constexpr int MAX_RAY_DEPTH = 2;
 
-constexpr int SCENE = 5;
+constexpr sampler_type SAMPLER = sampler_type::sobol;
 
-vec3 ray_color(const ray& r, const vec3& background, const hittable& scene, int depth = 1) {
-	if (depth <= 0)
-		return vec3(0, 0, 0);
+// Ambient occlusion skips shading altogether for quick previews of large scenes
+constexpr render_mode MODE = render_mode::path_tracing;
+constexpr int AO_SAMPLES = 4;
+constexpr double AO_DISTANCE = 20;
 
-	hit info;
-	if (!scene.test_hit(r, 0.01, INFINITY, info))
-		return background;
+// Progressive mode renders the whole frame in passes of 1, 2, 4, ... samples
+// per pixel and rewrites PROGRESS_FILE after every pass.
+constexpr bool PROGRESSIVE = false;
+constexpr const char* PROGRESS_FILE = "progress.ppm";
 
-	vec3 emitted = info.material_pointer->emitted(info.u, info.v, info.point);
-	vec3 attenuation;
-	ray scattered;
+// Wall clock budget in seconds, 0 means no limit. A budgeted render goes
+// in passes of 1, 2, 4, ... samples as in progressive mode, so every pixel
+// has samples early. When it runs out the render stops and the image is
+// written with the samples taken so far.
+constexpr double TIME_BUDGET = 0;
 
-	if (!info.material_pointer->scatter(r, info, attenuation, scattered))
-		return emitted;
+// Filters the final image with the à-trous denoiser, guided by first hit
+// albedo, normal and depth. WRITE_AOVS dumps those buffers as PPM files.
+constexpr bool DENOISE = false;
+constexpr bool WRITE_AOVS = false;
 
-	return emitted + attenuation * ray_color(scattered, background, scene, depth - 1);
-}
+// First hit albedo, normal and depth are only traced for the above
+constexpr bool NEED_AOVS = DENOISE || WRITE_AOVS;
 
-std::shared_ptr<lambertian> make_checker_material() {
-	return std::make_shared<lambertian>(
-	    std::make_shared<checker_texture>(
-	        vec3(0.2, 0.3, 0.1), vec3(0.9, 0.9, 0.9)));
-}
+// PPM goes to standard output, the other formats to OUTPUT_FILE. PNG is
+// 8 bit through TONE_CURVE and EXR half float radiance; both compress the
+// rows of the last pass while the rest of it renders.
+constexpr image_format OUTPUT_FORMAT = image_format::ppm;
+constexpr const char* OUTPUT_FILE = "render.png";
+constexpr tone_curve TONE_CURVE = tone_curve::clamp;
 
-std::shared_ptr<lambertian> make_perlin_noise_material(double scale) {
-	return std::make_shared<lambertian>(
-	    std::make_shared<noise_texture>(scale));
-}
+constexpr int SCENE = 5;
 
-std::shared_ptr<lambertian> make_random_albedo() {
-	return std::make_shared<lambertian>(
-	    vec3_random() * vec3_random());
+// Diffuse hits sample an emitter directly, picked by importance from the
+// light tree or uniformly, besides bouncing into them
+constexpr bool SAMPLE_LIGHTS = true;
+constexpr light_selection LIGHT_SELECTION = light_selection::tree;
+
+// Path guiding learns where light reaches each part of the scene from during
+// the first GUIDING_PASSES passes, of 1, 2, 4, ... spp, and then diffuse
+// bounces sample a quarter of their directions from what it learned
+constexpr bool PATH_GUIDING = false;
+constexpr int GUIDING_PASSES = 5;
+constexpr size_t GUIDING_MEMORY = 64 * 1024 * 1024;
+
+// Traces a photon map for caustics before rendering. CAUSTIC_PHOTONS of them
+// land on diffuse surfaces through metal or glass, and each estimate takes
+// the CAUSTIC_NEIGHBOURS closest within CAUSTIC_RADIUS.
+constexpr bool CAUSTICS = false;
+constexpr size_t CAUSTIC_PHOTONS = 200000;
+constexpr int CAUSTIC_NEIGHBOURS = 64;
+constexpr double CAUSTIC_RADIUS = 2;
+
+// Memory cap for the image texture tiles kept decoded at once
+constexpr size_t TEXTURE_CACHE_SIZE = 64 * 1024 * 1024;
+
+// Renders through static_scene, which calls the built-in primitives and
+// materials directly instead of through their virtual interfaces
+constexpr bool STATIC_DISPATCH = true;
+
+// What static_scene traces rays through. The uniform grid suits many small
+// objects of similar size, benchmark.cpp tells which is faster per scene.
+constexpr accelerator ACCELERATOR = accelerator::bvh;
+
+// Pins every render thread to its own CPU, keeps a copy of the static scene
+// on each NUMA node and has the frame rows first touched by the thread that
+// renders them. Single node machines only get the pinning.
+constexpr bool NUMA_AWARE = false;
+
+// Rows handed to a thread at a time, also what it first touches
+constexpr int ROW_BLOCK = 8;
+
+// Records when each thread built, rendered and wrote what, down to single
+// scanlines, and saves it to TRACE_FILE as a Chrome trace
+constexpr bool TRACE = false;
+constexpr const char* TRACE_FILE = "trace.json";
+
+// Keeps the frame buffer in FRAME_FILE, mapped into memory, instead of in
+// RAM. Each block of rows is handed back to the OS once rendered and once
+// written out, so resident memory stays bounded at any resolution. The file
+// is temporary: it is removed as soon as it is mapped, but holds disk space
+// the size of the frame until the render ends. The denoiser still needs the
+// whole image in memory.
+constexpr bool OUT_OF_CORE = false;
+constexpr const char* FRAME_FILE = "frame.bin";
+
+// The frame buffer is stored by row, so a block of rows is contiguous memory
+framebuffer frame(WIDTH, HEIGHT, ROW_BLOCK, OUT_OF_CORE ? FRAME_FILE : nullptr);
+
+numa_topology topology;
+std::vector<int> cpu_order;
+
+// Pins the calling OpenMP thread in NUMA aware mode
+void place_thread() {
+	if (NUMA_AWARE)
+		pin_thread(topology, cpu_order[omp_get_thread_num() % cpu_order.size()]);
 }
 
-std::shared_ptr<dielectric> make_dielectric() {
-	return std::make_shared<dielectric>(1.5);
+// Writes the frame buffer with the same row schedule as render_pass, so
+// under first touch each block of rows lives on its thread's node
+void first_touch_frame() {
+	#pragma omp parallel
+	{
+		place_thread();
+
+		#pragma omp for schedule(static, ROW_BLOCK)
+		for (int j = HEIGHT - 1; j >= 0; --j)
+			for (int i = 0; i < WIDTH; ++i)
+				frame(i, j) = pixel_record{};
+	}
 }
 
-std::shared_ptr<sphere> make_small_sphere(vec3 center, std::shared_ptr<material> material) {
-	return std::make_shared<sphere>(center, 0.2, material);
+using render_clock = std::chrono::steady_clock;
+
+bool out_of_time(render_clock::time_point deadline) {
+	return TIME_BUDGET > 0 && render_clock::now() >= deadline;
 }
 
-hittable_list random_scene() {
-	hittable_list scene;
+// Adds pass_samples samples to every pixel. Pixels reached after the deadline
+// are left untouched, so each pixel is averaged over its own sample count.
+// Rows are handed to output as they are finished, if given one.
+template<typename Scene>
+void render_pass(const camera& c, const vec3& background, const Scene& scene, int pass_samples, render_clock::time_point deadline, image_writer* output = nullptr, path_guide* guide = nullptr) {
+	int scanlines = HEIGHT - 1;
 
-	scene.objects.push_back(std::make_shared<sphere>(vec3(0, -1000, 0), 1000, make_checker_material()));
+	#pragma omp parallel
+	{
+		place_thread();
+		const auto& local = local_copy(scene);
 
-	for (int a = -11; a < 11; a++) {
-		for (int b = -11; b < 11; b++) {
+		auto pixel_sampler = make_sampler(SAMPLER, SAMPLES);
+		sampler& s = *pixel_sampler;
 
-			auto material_probability = random_double();
+		#pragma omp for schedule(static, ROW_BLOCK)
+		for (int j = HEIGHT - 1; j >= 0; --j) {
+			timeline_scope scope("render", "scanline", "row", HEIGHT - 1 - j);
 
-			vec3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+			if (scanlines % 16 == 0)
+				std::cerr << "\rScanlines remaining: " << scanlines << ' ' << std::flush;
 
-			if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
-				if (material_probability < 0.8) {
-					auto moving_sphere = make_small_sphere(center, make_random_albedo());
-					moving_sphere->velocity = vec3(0.0, 0.1, 0.0);
-					scene.objects.push_back(moving_sphere);
+			for (int i = 0; i < WIDTH; ++i) {
 
-				} else if (material_probability < 0.95) {
-					auto albedo = vec3_random(0.5, 1);
-					auto fuzz = random_double(0, 0.5);
-					auto metal_material = std::make_shared<metal>(albedo, fuzz);
-					scene.objects.push_back(make_small_sphere(center, metal_material));
+				if (out_of_time(deadline))
+					break;
 
-				} else {
-					scene.objects.push_back(make_small_sphere(center, make_dielectric()));
+				auto& pixel = frame(i, j);
+
+				vec3 color(0, 0, 0);
+				aov_sample pixel_aov;
+				for (int k = 0; k < pass_samples; k++) {
+					s.start_sample(i, j, pixel.samples + k);
+
+					real du, dv;
+					s.get_2d(du, dv);
+
+					real h = (i + du) / (WIDTH - 1);
+					real v = (j + dv) / (HEIGHT - 1);
+					ray r = c.shoot_ray(h, v, s);
+
+					aov_sample aov;
+					aov_sample* first_hit = NEED_AOVS ? &aov : nullptr;
+					if (MODE == render_mode::ambient_occlusion)
+						color += ambient_occlusion(r, background, local, s, AO_SAMPLES, AO_DISTANCE, first_hit);
+					else
+						color += ray_color(r, background, local, s, MAX_RAY_DEPTH, first_hit, nullptr, guide);
+
+					if (NEED_AOVS) {
+						pixel_aov.albedo += aov.albedo;
+						pixel_aov.normal += aov.normal;
+						pixel_aov.depth += aov.depth;
+					}
+				}
+
+				if (NEED_AOVS) {
+					pixel.albedo += pixel_aov.albedo;
+					pixel.normal += pixel_aov.normal;
+					pixel.depth += pixel_aov.depth;
 				}
+				pixel.color += color;
+				pixel.samples += pass_samples;
 			}
+
+			if (output)
+				output->row_done(HEIGHT - 1 - j);
+			frame.row_done(j);
+
+			#pragma omp atomic
+			scanlines--;
 		}
 	}
 
-	scene.objects.push_back(std::make_shared<sphere>(vec3(0, 1, 0), 1.0, make_dielectric()));
-
-	auto material2 = std::make_shared<lambertian>(vec3(0.4, 0.2, 0.1));
-	scene.objects.push_back(std::make_shared<sphere>(vec3(-4, 1, 0), 1.0, material2));
+	std::cerr << "\rScanlines remaining: 0 " << std::flush;
+}
 
-	auto material3 = std::make_shared<metal>(vec3(0.7, 0.6, 0.5), 0.0);
-	scene.objects.push_back(std::make_shared<sphere>(vec3(4, 1, 0), 1.0, material3));
+void write_image(std::ostream& out) {
+	out << "P6\n" << WIDTH << ' ' << HEIGHT << "\n255\n";
+	for (int j = HEIGHT - 1; j >= 0; --j) {
+		for (int i = 0; i < WIDTH; ++i)
+			write_color(out, frame(i, j).color, frame(i, j).samples);
 
-	return scene;
+		// Blocks of rows are read top down, so this was the last of its block
+		if (j % ROW_BLOCK == 0)
+			frame.release(j);
+	}
 }
 
-hittable_list two_spheres() {
-	hittable_list scene;
+// Mean radiance of a pixel, y = 0 being the top row. Encoders read rows top
+// down, so the end of a block's bottom row releases it.
+vec3 pixel_color(int x, int y) {
+	const int j = HEIGHT - 1 - y;
+	const auto& pixel = frame(x, j);
+	const auto color = pixel.samples ? pixel.color / pixel.samples : vec3(0, 0, 0);
 
-	scene.objects.push_back(std::make_shared<sphere>(vec3(0, -10, 0), 10, make_checker_material()));
-	scene.objects.push_back(std::make_shared<sphere>(vec3(0,  10, 0), 10, make_checker_material()));
+	if (x == WIDTH - 1 && j % ROW_BLOCK == 0)
+		frame.release(j);
 
-	return scene;
+	return color;
 }
 
-hittable_list two_perlin_spheres() {
-	hittable_list scene;
-
-	auto material = make_perlin_noise_material(4);
-	scene.objects.push_back(std::make_shared<sphere>(vec3(0, -1000, 0), 1000, material));
-	scene.objects.push_back(std::make_shared<sphere>(vec3(0, 2, 0), 2, material));
-
-	return scene;
+// Writes a per pixel average, buffer[i * HEIGHT + j], as an 8 bit PPM
+void write_buffer(const char* path, const std::vector<vec3>& buffer) {
+	std::ofstream out(path, std::ios::binary);
+	out << "P6\n" << WIDTH << ' ' << HEIGHT << "\n255\n";
+	for (int j = HEIGHT - 1; j >= 0; --j)
+		for (int i = 0; i < WIDTH; ++i)
+			write_color(out, buffer[i * HEIGHT + j], 1);
 }
 
-hittable_list simple_light() {
-	hittable_list scene;
+// Replaces the screen with its denoised version, one sample per pixel
+void denoise_screen() {
+	timeline_scope scope("post", "denoise");
 
-	auto material = make_perlin_noise_material(4);
-	scene.objects.push_back(std::make_shared<sphere>(vec3(0, -1000, 0), 1000, material));
-	scene.objects.push_back(std::make_shared<sphere>(vec3(0, 2, 0), 2, material));
+	const size_t size = WIDTH * HEIGHT;
 
-	auto light = std::make_shared<diffuse_light>(vec3(4, 4, 4));
-	scene.objects.push_back(std::make_shared<xy_rect>(vec3(1.5, 1.5, -2), 2, 2, light));
+	std::vector<vec3> color(size);
+	std::vector<vec3> albedo(size);
+	std::vector<vec3> normal(size);
+	std::vector<float> depth(size);
 
-	return scene;
-}
+	double max_depth = 0;
 
-hittable_list cornell_box() {
-	hittable_list scene;
+	for (int i = 0; i < WIDTH; ++i)
+		for (int j = 0; j < HEIGHT; ++j) {
+			const auto p = i * HEIGHT + j;
+			const auto& pixel = frame(i, j);
+			const auto n = pixel.samples ? pixel.samples : 1;
 
-	auto red = std::make_shared<lambertian>(vec3(.65, .05, .05));
-	auto white = std::make_shared<lambertian>(vec3(.73, .73, .73));
-	auto green = std::make_shared<lambertian>(vec3(.12, .45, .15));
-	auto light = std::make_shared<diffuse_light>(vec3(15, 15, 15));
+			color[p] = pixel.color / n;
+			albedo[p] = pixel.albedo / n;
+			normal[p] = pixel.normal.zero() ? vec3(0, 0, 0) : unit_vector(pixel.normal);
+			depth[p] = pixel.depth / n;
 
-	scene.objects.push_back(std::make_shared<yz_rect>(vec3(-50,  0, -50), 100, 100, green));
-	scene.objects.push_back(std::make_shared<yz_rect>(vec3( 50,  0, -50), 100, 100, red));
-	scene.objects.push_back(std::make_shared<xz_rect>(vec3( 0, -50, -50), 100, 100, white));
-	scene.objects.push_back(std::make_shared<xz_rect>(vec3( 0,  50, -50), 100, 100, white));
-	scene.objects.push_back(std::make_shared<xy_rect>(vec3( 0,  0, -100), 100, 100, white));
-	scene.objects.push_back(std::make_shared<xz_rect>(vec3( 0,  49.5, -50), 20, 20, light));
+			max_depth = std::max(max_depth, (double)depth[p]);
+		}
 
-	return scene;
-}
+	if (WRITE_AOVS) {
+		std::vector<vec3> normal_image(size);
+		std::vector<vec3> depth_image(size);
 
-vec3 screen[WIDTH][HEIGHT];
+		for (size_t p = 0; p < size; p++) {
+			normal_image[p] = normal[p].zero() ? vec3(0, 0, 0) : vec3_unit_map(normal[p]);
+			depth_image[p] = vec3(1, 1, 1) * (max_depth > 0 ? depth[p] / max_depth : 0);
+		}
 
-hittable_list choose_scene(int scene) {
-	switch (scene) {
-		default:
-		case 1: return random_scene();
-		case 2: return two_spheres();
-		case 3: return two_perlin_spheres();
-		case 4: return simple_light();
-		case 5: return cornell_box();
+		write_buffer("albedo.ppm", albedo);
+		write_buffer("normal.ppm", normal_image);
+		write_buffer("depth.ppm", depth_image);
 	}
+
+	if (!DENOISE)
+		return;
+
+	const auto filtered = denoiser(WIDTH, HEIGHT).run(color, albedo, normal, depth);
+
+	for (int i = 0; i < WIDTH; ++i)
+		for (int j = 0; j < HEIGHT; ++j) {
+			frame(i, j).color = filtered[i * HEIGHT + j];
+			frame(i, j).samples = 1;
+		}
 }
 
 int main() {
 	double start_time = 0;
 	double end_time = 1;
 
+	const auto start = render_clock::now();
+	const auto deadline = start + std::chrono::duration_cast<render_clock::duration>(
+		std::chrono::duration<double>(TIME_BUDGET));
+
 	vec3 background = vec3(0.5, 0.5, 0.5);
 	
-	bvh_node bvh(choose_scene(SCENE), start_time, end_time);
+	shared_texture_cache().capacity = TEXTURE_CACHE_SIZE;
+	shared_timeline().enabled = TRACE;
 
-	camera c(vec3(0, 0, 100), vec3(0, 0, -100), vec3(0, 1, 0), M_PI / 4, ASPECT_RATIO, 0.1, 10);
+	if (!frame.ok()) {
+		std::cerr << "Could not allocate the frame buffer\n";
+		return 1;
+	}
 
-	int scanlines = HEIGHT - 1;
+	// Every object of the scene lives in the arena, released in one go at exit
+	scene_arena arena;
+	timeline_scope load("setup", "choose_scene");
+	const auto world = choose_scene(SCENE, arena);
+	load.end();
+
+	timeline_scope bvh_build("setup", "bvh_node");
+	bvh_node bvh(world, start_time, end_time, &arena);
+	bvh_build.end();
+	arena.report(std::cerr);
+
+	timeline_scope light_build("setup", "light_tree");
+	const light_tree lights(world, start_time, end_time, LIGHT_SELECTION);
+	light_build.end();
+	const auto light_sampling = SAMPLE_LIGHTS ? &lights : nullptr;
+	std::cerr << "Lights: " << lights.emitters.size() << " emitters\n";
+
+	timeline_scope static_build("setup", "static_scene");
+	const auto closed_world = STATIC_DISPATCH ? std::make_unique<static_scene>(world, start_time, end_time, light_sampling) : nullptr;
+	static_build.end();
+
+	if (closed_world && ACCELERATOR == accelerator::grid) {
+		timeline_scope grid_build("setup", "uniform_grid");
+		closed_world->select(ACCELERATOR);
+		const auto& g = closed_world->grid;
+		std::cerr << "Grid: " << g.resolution[0] << 'x' << g.resolution[1] << 'x' << g.resolution[2] << " cells, "
+		          << g.large.size() << " large primitives, " << g.memory() / 1024 << " KB\n";
+	}
 
-	#pragma omp parallel for
-	for (int j = HEIGHT - 1; j >= 0; --j) {
+	photon_map caustics(CAUSTIC_NEIGHBOURS, CAUSTIC_RADIUS);
+	const auto caustic_map = CAUSTICS ? &caustics : nullptr;
 
-		if (scanlines % 16 == 0)
-			std::cerr << "\rScanlines remaining: " << scanlines << ' ' << std::flush;
+	if (CAUSTICS) {
+		timeline_scope scope("setup", "photon_map");
+		const auto photon_start = render_clock::now();
 
-		for (int i = 0; i < WIDTH; ++i) {
+		if (closed_world)
+			caustics.emit(*closed_world, lights, start_time, end_time, CAUSTIC_PHOTONS);
+		else
+			caustics.emit(dynamic_scene(bvh), lights, start_time, end_time, CAUSTIC_PHOTONS);
 
-			vec3 color(0, 0, 0);
-			for (size_t s = 0; s < SAMPLES; s++) {
-				double h = (i + random_double()) / (WIDTH - 1);
-				double v = (j + random_double()) / (HEIGHT - 1);
-				ray r = c.shoot_ray(h, v);
-				color += ray_color(r, background, bvh, MAX_RAY_DEPTH);
-			}
-			
-			screen[i][j] = color;
+		const std::chrono::duration<double> photon_time = render_clock::now() - photon_start;
+		caustics.report(std::cerr);
+		std::cerr << "Photons traced in " << photon_time.count() << "s\n";
+
+		if (closed_world)
+			closed_world->caustics = caustic_map;
+	}
+
+	// Only the flat arrays of the static scene can be copied, the arena
+	// objects behind the dynamic path stay where they were built
+	std::unique_ptr<node_replicas<static_scene>> replicas;
+
+	if (NUMA_AWARE) {
+		topology = numa_topology::detect();
+		cpu_order = topology.cpu_order();
+		std::cerr << "NUMA: " << topology.nodes() << " nodes, " << cpu_order.size() << " CPUs\n";
+
+		first_touch_frame();
+		if (closed_world)
+			replicas = std::make_unique<node_replicas<static_scene>>(topology, *closed_world);
+	}
+
+	const auto guide = PATH_GUIDING ? std::make_unique<path_guide>(world, start_time, end_time, GUIDING_PASSES, GUIDING_MEMORY) : nullptr;
+
+	camera c(vec3(0, 0, 100), vec3(0, 0, -100), vec3(0, 1, 0), M_PI / 4, ASPECT_RATIO, 0.1, 10);
+	c.set_image_height(HEIGHT);
+
+	image_writer output(OUTPUT_FORMAT, WIDTH, HEIGHT, pixel_color, TONE_CURVE);
+
+	// Rows are only final in the last pass, which is known in advance unless
+	// the time budget can cut it short, and if nothing filters them later
+	const bool stream_output = output.streams() && TIME_BUDGET == 0 && !DENOISE;
+
+	int rendered = 0;
+	int pass_samples = PROGRESSIVE || PATH_GUIDING || TIME_BUDGET > 0 ? 1 : SAMPLES;
+
+	while (rendered < SAMPLES && !out_of_time(deadline)) {
+		pass_samples = std::min(pass_samples, SAMPLES - rendered);
+		const auto stream = stream_output && rendered + pass_samples == SAMPLES ? &output : nullptr;
+
+		std::cerr << "\nPass of " << pass_samples << " spp (" << rendered << " done)\n";
+		timeline_scope pass("render", "pass", "samples", pass_samples);
+		if (replicas)
+			render_pass(c, background, *replicas, pass_samples, deadline, stream, guide.get());
+		else if (closed_world)
+			render_pass(c, background, *closed_world, pass_samples, deadline, stream, guide.get());
+		else
+			render_pass(c, background, dynamic_scene(bvh, light_sampling, caustic_map), pass_samples, deadline, stream, guide.get());
+		rendered += pass_samples;
+		pass.end();
+
+		if (guide && guide->training()) {
+			timeline_scope scope("render", "guide_refine");
+			guide->refine();
+			std::cerr << '\n';
+			guide->report(std::cerr);
+
+			// Past training the rest of the samples can go in one pass,
+			// unless the time budget may cut it short
+			if (!guide->training() && !PROGRESSIVE && TIME_BUDGET == 0)
+				pass_samples = SAMPLES;
 		}
 
-		#pragma omp atomic
-		scanlines--;
+		if (PROGRESSIVE) {
+			timeline_scope scope("output", "progress");
+			std::ofstream progress(PROGRESS_FILE, std::ios::binary);
+			write_image(progress);
+		}
+
+		pass_samples *= 2;
 	}
 
-	std::cerr << "\rScanlines remaining: 0\nWriting..." << std::flush;
+	const std::chrono::duration<double> elapsed = render_clock::now() - start;
 
-	std::cout << "P6\n" << WIDTH << ' ' << HEIGHT << "\n255\n";
-	for (int j = HEIGHT - 1; j >= 0; --j)
-		for (int i = 0; i < WIDTH; ++i)
-			write_color(std::cout, screen[i][j], SAMPLES);
+	if (out_of_time(deadline))
+		std::cerr << "\nTime budget of " << TIME_BUDGET << "s exhausted";
+
+	std::cerr << "\nRendered in " << elapsed.count() << "s" << std::flush;
+
+	if (shared_texture_cache().textures) {
+		std::cerr << '\n';
+		shared_texture_cache().report(std::cerr);
+	}
+
+	if (NEED_AOVS) {
+		const auto denoise_start = render_clock::now();
+		denoise_screen();
+
+		const std::chrono::duration<double> denoise_time = render_clock::now() - denoise_start;
+		std::cerr << "\nPost pass in " << denoise_time.count() << "s" << std::flush;
+	}
+
+	std::cerr << "\nWriting..." << std::flush;
+
+	const auto write_start = render_clock::now();
+	timeline_scope write("output", "write");
+
+	if (OUTPUT_FORMAT == image_format::ppm)
+		write_image(std::cout);
+	else if (!output.write(OUTPUT_FILE))
+		std::cerr << "\nCould not write " << OUTPUT_FILE;
+
+	write.end();
+	const std::chrono::duration<double> write_time = render_clock::now() - write_start;
+	std::cerr << "\nWritten in " << write_time.count() << "s";
+
+	if (TRACE) {
+		if (shared_timeline().write(TRACE_FILE))
+			std::cerr << "\nTrace of " << shared_timeline().events() << " events written to " << TRACE_FILE;
+		else
+			std::cerr << "\nCould not write " << TRACE_FILE;
+	}
 
 	std::cerr << "\nDone.\n";
 }
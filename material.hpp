@@ -5,15 +5,27 @@
 #include "hittable.hpp"
 #include "utils.hpp"
 #include "texture.hpp"
+#include "sampler.hpp"
 
 struct hit;
 
 struct material {
-	virtual bool scatter(const ray& r_in, const hit& info, vec3& attenuation, ray& scattered) const = 0;
+	virtual bool scatter(const ray& r_in, const hit& info, vec3& attenuation, ray& scattered, sampler& s) const = 0;
 
-	virtual vec3 emitted(double u, double v, const vec3& p) const {
+	virtual vec3 emitted(real u, real v, const vec3& p) const {
 		return vec3(0, 0, 0);
 	}
+
+	// Surface color as seen by the denoiser, white for materials without one
+	virtual vec3 surface_albedo(const hit& info) const {
+		return vec3(1, 1, 1);
+	}
+
+	// Whether scatter reflects with a cosine distribution and attenuates by
+	// the albedo, which lets direct light be sampled towards the emitters
+	virtual bool diffuse() const {
+		return false;
+	}
 };
 
 struct lambertian : material {
@@ -23,14 +35,25 @@ struct lambertian : material {
 	lambertian(const vec3& color) : albedo{std::make_shared<solid_color>(color)} {}
 	lambertian(std::shared_ptr<texture> albedo) : albedo{albedo} {}
 
-	virtual bool scatter(const ray& r_in, const hit& info, vec3& attenuation, ray& scattered) const override {
-		vec3 direction = info.normal + random_unit_vector();
+	virtual bool scatter(const ray& r_in, const hit& info, vec3& attenuation, ray& scattered, sampler& s) const override {
+		real u1, u2;
+		s.get_2d(u1, u2);
+
+		vec3 direction = info.normal + random_unit_vector(u1, u2);
 		if (direction.zero())
 			direction = info.normal;
 
-		attenuation = albedo->value(info.u, info.v, info.point);
-		scattered = ray(info.point, direction, r_in.time);
+		attenuation = albedo->filtered_value(info.u, info.v, info.point, info.footprint);
+		scattered = info.spawn_ray(direction, r_in.time);
+
+		return true;
+	}
+
+	virtual vec3 surface_albedo(const hit& info) const override {
+		return albedo->filtered_value(info.u, info.v, info.point, info.footprint);
+	}
 
+	virtual bool diffuse() const override {
 		return true;
 	}
 };
@@ -38,48 +61,56 @@ struct lambertian : material {
 struct metal : material {
 
 	vec3 color;
-	double fuzzyness;
+	real fuzzyness;
+
+	metal(const vec3& color, real fuzz) : color(color), fuzzyness(fuzz < 1 ? fuzz : 1) {}
 
-	metal(const vec3& color, double fuzz) : color(color), fuzzyness(fuzz < 1 ? fuzz : 1) {}
+	virtual bool scatter(const ray& r_in, const hit& info, vec3& attenuation, ray& scattered, sampler& s) const override {
+		real u1, u2;
+		s.get_2d(u1, u2);
+		const auto u3 = s.get_1d();
 
-	virtual bool scatter(const ray& r_in, const hit& info, vec3& attenuation, ray& scattered) const override {
 		vec3 direction = reflect(unit_vector(r_in.direction), info.normal);
 		attenuation = color;
-		scattered = ray(info.point, direction + fuzzyness * random_in_unit_sphere(), r_in.time);
+		scattered = info.spawn_ray(direction + fuzzyness * random_in_unit_sphere(u1, u2, u3), r_in.time);
 
 		return (dot(scattered.direction, info.normal) > 0);
 	}
+
+	virtual vec3 surface_albedo(const hit& info) const override {
+		return color;
+	}
 };
 
 struct dielectric : material {
 
-	double index;
+	real index;
 
-	dielectric(double index) : index(index) {}
+	dielectric(real index) : index(index) {}
 
-	virtual bool scatter(const ray& r_in, const hit& info, vec3& attenuation, ray& scattered) const override {
-		double refraction_ratio = info.front_face ? (1 / index) : index;
+	virtual bool scatter(const ray& r_in, const hit& info, vec3& attenuation, ray& scattered, sampler& s) const override {
+		real refraction_ratio = info.front_face ? (1 / index) : index;
 
 		vec3 unit_direction = unit_vector(r_in.direction);
-		double cos_theta = fmin(dot(-unit_direction, info.normal), 1.0);
-		double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+		real cos_theta = std::fmin(dot(-unit_direction, info.normal), real(1));
+		real sin_theta = std::sqrt(1 - cos_theta * cos_theta);
 
 		vec3 direction =
-			refraction_ratio * sin_theta > 1.0 || reflectance(cos_theta, refraction_ratio) > random_double()
+			refraction_ratio * sin_theta > 1 || reflectance(cos_theta, refraction_ratio) > s.get_1d()
 			? reflect(unit_direction, info.normal)
 			: refract(unit_direction, info.normal, refraction_ratio);
 
 		attenuation = vec3(1, 1, 1);
-		scattered = ray(info.point, direction, r_in.time);
+		scattered = info.spawn_ray(direction, r_in.time);
 
 		return true;
 	}
 
 	// Schlick's approximation for reflectance
-	static double reflectance(double cos_theta, double refraction) {
+	static real reflectance(real cos_theta, real refraction) {
 		auto r0 = (1 - refraction) / (1 + refraction);
 		r0 = r0 * r0;
-		return r0 + (1 - r0) * pow((1 - cos_theta), 5);
+		return r0 + (1 - r0) * std::pow(1 - cos_theta, real(5));
 	}
 };
 
@@ -90,11 +121,15 @@ struct diffuse_light : material {
 	diffuse_light(std::shared_ptr<texture> texture) : emitter{texture} {}
 	diffuse_light(const vec3& color) : emitter{std::make_shared<solid_color>(color)} {}
 
-	virtual bool scatter(const ray& r_in, const hit& info, vec3& attenuation, ray& scattered) const override {
+	virtual bool scatter(const ray& r_in, const hit& info, vec3& attenuation, ray& scattered, sampler& s) const override {
 		return false;
 	}
 
-	virtual vec3 emitted(double u, double v, const vec3& p) const override {
+	virtual vec3 emitted(real u, real v, const vec3& p) const override {
 		return emitter->value(u, v, p);
 	}
+
+	virtual vec3 surface_albedo(const hit& info) const override {
+		return emitter->value(info.u, info.v, info.point);
+	}
 };
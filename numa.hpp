@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+// NUMA placement without libnuma. Nodes and their CPUs come from sysfs, and
+// memory ends up on a node by being first touched from a thread pinned to
+// it. Machines without NUMA, or where sysfs can't be read, are one node
+// holding every CPU the process may run on.
+
+struct numa_topology {
+
+	// CPUs of each node, limited to the ones the process may run on
+	std::vector<std::vector<int>> node_cpus;
+
+	int nodes() const {
+		return node_cpus.size();
+	}
+
+	// Every usable CPU, spread round robin over the nodes, so the first
+	// threads are placed on different nodes
+	std::vector<int> cpu_order() const {
+		std::vector<int> order;
+		for (size_t k = 0; order.size() < cpu_count(); k++)
+			for (const auto& cpus : node_cpus)
+				if (k < cpus.size())
+					order.push_back(cpus[k]);
+		return order;
+	}
+
+	size_t cpu_count() const {
+		size_t count = 0;
+		for (const auto& cpus : node_cpus)
+			count += cpus.size();
+		return count;
+	}
+
+	int node_of(int cpu) const {
+		for (int n = 0; n < nodes(); n++)
+			if (std::find(node_cpus[n].begin(), node_cpus[n].end(), cpu) != node_cpus[n].end())
+				return n;
+		return 0;
+	}
+
+	// Parses lists such as "0-3,8-11"
+	static std::vector<int> parse_cpu_list(const std::string& text) {
+		std::vector<int> cpus;
+		std::stringstream in(text);
+		std::string range;
+
+		while (std::getline(in, range, ',')) {
+			const auto dash = range.find('-');
+			try {
+				const int first = std::stoi(range.substr(0, dash));
+				const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+				for (int cpu = first; cpu <= last; cpu++)
+					cpus.push_back(cpu);
+			} catch (const std::exception&) {
+			}
+		}
+
+		return cpus;
+	}
+
+	static numa_topology detect() {
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+			for (unsigned cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); cpu++)
+				CPU_SET(cpu, &allowed);
+
+		numa_topology topology;
+
+		std::error_code error;
+		std::vector<std::filesystem::path> node_paths;
+		for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", error)) {
+			const auto name = entry.path().filename().string();
+			if (name.size() > 4 && name.compare(0, 4, "node") == 0 && std::isdigit(name[4]))
+				node_paths.push_back(entry.path());
+		}
+
+		std::sort(node_paths.begin(), node_paths.end(), [](const auto& a, const auto& b) {
+			return std::stoi(a.filename().string().substr(4)) < std::stoi(b.filename().string().substr(4));
+		});
+
+		for (const auto& path : node_paths) {
+			std::ifstream list(path / "cpulist");
+			std::string text;
+			std::getline(list, text);
+
+			std::vector<int> cpus;
+			for (const auto cpu : parse_cpu_list(text))
+				if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+					cpus.push_back(cpu);
+
+			if (!cpus.empty())
+				topology.node_cpus.push_back(cpus);
+		}
+
+		if (topology.node_cpus.empty()) {
+			topology.node_cpus.emplace_back();
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &allowed))
+					topology.node_cpus[0].push_back(cpu);
+		}
+
+		return topology;
+	}
+};
+
+// Node the calling thread was last pinned to
+inline int& current_numa_node() {
+	thread_local int node = 0;
+	return node;
+}
+
+inline bool pin_thread(const numa_topology& topology, int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		return false;
+
+	current_numa_node() = topology.node_of(cpu);
+	return true;
+}
+
+// One copy of a read only object per node, each made by a thread pinned to
+// that node so its memory is local there. A single node keeps the original.
+template<typename T>
+struct node_replicas {
+
+	const T& original;
+	std::vector<std::unique_ptr<T>> replicas;
+
+	node_replicas(const numa_topology& topology, const T& original) : original{original} {
+		if (topology.nodes() < 2)
+			return;
+
+		replicas.resize(topology.nodes());
+		for (int n = 0; n < topology.nodes(); n++)
+			std::thread([&, n] {
+				pin_thread(topology, topology.node_cpus[n].front());
+				replicas[n] = std::make_unique<T>(original);
+			}).join();
+	}
+
+	const T& local() const {
+		return replicas.empty() ? original : *replicas[current_numa_node()];
+	}
+};
+
+// What the calling thread should read: its node's replica, or the object
+// itself when it isn't replicated
+template<typename T>
+const T& local_copy(const T& object) {
+	return object;
+}
+
+template<typename T>
+const T& local_copy(const node_replicas<T>& replicas) {
+	return replicas.local();
+}
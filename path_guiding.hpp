@@ -0,0 +1,428 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "aabb.hpp"
+#include "hittable.hpp"
+#include "sampler.hpp"
+#include "utils.hpp"
+#include "vec3.hpp"
+
+// Online path guiding after Müller et al., "Practical Path Guiding for
+// Efficient Light-Transport Simulation". A binary tree over the scene bounds
+// holds in each leaf a quadtree over directions, which learns how much light
+// arrives from where. Training goes in passes: during one, render threads add
+// what they find to the building quadtrees, and between passes the trees are
+// refined and the learned ones become what diffuse bounces sample from.
+//
+// Directions map to the unit square through the cylindrical mapping of
+// random_unit_vector, which preserves area, so a density over the square is
+// 4 pi times the density over solid angle.
+
+inline real luminance(const vec3& c) {
+	return real(0.2126) * c.x + real(0.7152) * c.y + real(0.0722) * c.z;
+}
+
+inline void direction_to_square(const vec3& unit_direction, real& u, real& v) {
+	u = std::clamp((1 - unit_direction.z) / 2, real(0), real(1));
+	v = std::atan2(unit_direction.y, unit_direction.x) / (2 * PI);
+	if (v < 0)
+		v += 1;
+}
+
+// Directional distribution. Each node keeps the energy that arrived through
+// each of its four quadrants, and the node subdividing a quadrant if any.
+struct quadtree {
+
+	struct node {
+		float energy[4] = {0, 0, 0, 0};
+		uint32_t child[4] = {0, 0, 0, 0};
+	};
+
+	// The root is the first node, so a child index of 0 means a leaf
+	std::vector<node> nodes = std::vector<node>(1);
+
+	static int quadrant(real& u, real& v) {
+		const int q = (u >= real(0.5)) + 2 * (v >= real(0.5));
+		u = 2 * u - (q & 1);
+		v = 2 * v - (q >> 1);
+		return q;
+	}
+
+	float total() const {
+		const auto& root = nodes[0];
+		return root.energy[0] + root.energy[1] + root.energy[2] + root.energy[3];
+	}
+
+	// Safe to call from several threads at once
+	void add(const vec3& unit_direction, float value) {
+		real u, v;
+		direction_to_square(unit_direction, u, v);
+
+		for (uint32_t n = 0;;) {
+			const int q = quadrant(u, v);
+
+			#pragma omp atomic
+			nodes[n].energy[q] += value;
+
+			n = nodes[n].child[q];
+			if (n == 0)
+				return;
+		}
+	}
+
+	// Density over solid angle, uniform over the sphere while empty
+	real pdf(const vec3& unit_direction) const {
+		real u, v;
+		direction_to_square(unit_direction, u, v);
+
+		real density = 1;
+		for (uint32_t n = 0;;) {
+			const auto& e = nodes[n].energy;
+			const auto sum = e[0] + e[1] + e[2] + e[3];
+			if (sum <= 0)
+				break;
+
+			const int q = quadrant(u, v);
+			density *= 4 * e[q] / sum;
+
+			n = nodes[n].child[q];
+			if (n == 0)
+				break;
+		}
+
+		return density / (4 * PI);
+	}
+
+	vec3 sample(real u1, real u2) const {
+		real u = 0, v = 0;
+		real size = 1;
+
+		for (uint32_t n = 0;;) {
+			const auto& e = nodes[n].energy;
+			const auto sum = e[0] + e[1] + e[2] + e[3];
+			if (sum <= 0)
+				break;
+
+			// Top or bottom half first, then left or right, reusing u1
+			const auto top = e[0] + e[1];
+			int q;
+			if (u1 * sum < top) {
+				u1 = u1 * sum / top;
+				q = u2 * top < e[0] ? 0 : 1;
+				u2 = q == 0 ? u2 * top / e[0] : (u2 * top - e[0]) / e[1];
+			} else {
+				u1 = (u1 * sum - top) / (sum - top);
+				q = u2 * (sum - top) < e[2] ? 2 : 3;
+				u2 = q == 2 ? u2 * (sum - top) / e[2] : (u2 * (sum - top) - e[2]) / e[3];
+			}
+
+			size /= 2;
+			u += (q & 1) * size;
+			v += (q >> 1) * size;
+
+			n = nodes[n].child[q];
+			if (n == 0)
+				break;
+		}
+
+		// Within the leaf the density is constant
+		return random_unit_vector(u + std::min(u2, real(0.999999)) * size, v + std::min(u1, real(0.999999)) * size);
+	}
+
+	// Empty tree of the same structure, with quadrants holding more than
+	// `threshold` of the energy subdivided and the rest merged, taking at
+	// most max_nodes nodes
+	quadtree refined(real threshold, int max_depth, size_t max_nodes) const {
+		quadtree result;
+
+		const auto sum = total();
+		if (sum <= 0)
+			return result;
+
+		// Quadrants of a former leaf have a quarter of its energy each
+		struct entry {
+			uint32_t from;
+			float uniform_energy;
+			uint32_t to;
+			int depth;
+		};
+
+		// Breadth first, so the budget goes to the coarse levels first
+		std::vector<entry> queue = {{0, 0, 0, 1}};
+		for (size_t k = 0; k < queue.size(); k++) {
+			const auto [from, uniform_energy, to, depth] = queue[k];
+
+			for (int q = 0; q < 4; q++) {
+				const auto energy = from == UINT32_MAX ? uniform_energy : nodes[from].energy[q];
+				if (energy <= threshold * sum || depth >= max_depth || result.nodes.size() >= max_nodes)
+					continue;
+
+				const uint32_t child = result.nodes.size();
+				result.nodes.emplace_back();
+				result.nodes[to].child[q] = child;
+
+				const auto old_child = from == UINT32_MAX ? 0 : nodes[from].child[q];
+				queue.push_back({old_child ? old_child : UINT32_MAX, energy / 4, child, depth + 1});
+			}
+		}
+
+		return result;
+	}
+
+	// Copy keeping the coarsest max_nodes nodes. A quadrant whose node is
+	// dropped becomes a leaf with the energy of everything below it.
+	quadtree pruned(size_t max_nodes) const {
+		if (nodes.size() <= max_nodes)
+			return *this;
+
+		quadtree result;
+		result.nodes[0] = nodes[0];
+
+		std::vector<uint32_t> queue = {0};
+		for (size_t k = 0; k < queue.size(); k++) {
+			const auto to = k;
+			const auto from = queue[k];
+
+			for (int q = 0; q < 4; q++) {
+				const auto old_child = nodes[from].child[q];
+				if (old_child == 0 || result.nodes.size() >= max_nodes) {
+					result.nodes[to].child[q] = 0;
+					continue;
+				}
+
+				result.nodes[to].child[q] = result.nodes.size();
+				result.nodes.push_back(nodes[old_child]);
+				queue.push_back(old_child);
+			}
+		}
+
+		return result;
+	}
+
+	void clear() {
+		for (auto& n : nodes)
+			std::fill(n.energy, n.energy + 4, 0.f);
+	}
+};
+
+// How a diffuse bounce picks its direction: the cosine lobe of the
+// material, or with probability `fraction` what was learned around the hit.
+// Without anything learned it is the cosine lobe alone.
+struct guided_lobe {
+
+	vec3 normal;
+	real fraction = 0;
+	const quadtree* learned = nullptr;
+
+	// Where what the bounce finds is recorded, while training
+	quadtree* building = nullptr;
+
+	guided_lobe(const vec3& normal) : normal{normal} {}
+
+	real pdf(const vec3& unit_direction) const {
+		const auto cosine = std::max(dot(unit_direction, normal), real(0)) / PI;
+		if (fraction <= 0)
+			return cosine;
+		return (1 - fraction) * cosine + fraction * learned->pdf(unit_direction);
+	}
+
+	// Replaces a direction drawn from the cosine lobe by a learned one with
+	// probability `fraction`
+	void sample(sampler& s, vec3& direction) const {
+		const auto choice = s.get_1d();
+
+		real u1, u2;
+		s.get_2d(u1, u2);
+
+		if (choice < fraction)
+			direction = learned->sample(u1, u2);
+	}
+
+	// Adds radiance arriving from a direction sampled with density pdf
+	void record(const vec3& unit_direction, const vec3& radiance, real pdf) const {
+		if (!building || pdf <= 0)
+			return;
+
+		const auto value = luminance(radiance) / pdf;
+		if (value > 0 && std::isfinite(value))
+			building->add(unit_direction, value);
+	}
+};
+
+struct path_guide {
+
+	// A leaf of the spatial tree
+	struct cell {
+		quadtree learned;
+		quadtree building;
+		uint32_t samples = 0;
+	};
+
+	// Splits its box in half along axis, or is a leaf when child[0] is 0
+	struct spatial_node {
+		int axis = 0;
+		uint32_t child[2] = {0, 0};
+		uint32_t cell = 0;
+	};
+
+	aabb bounds;
+	std::vector<spatial_node> spatial = std::vector<spatial_node>(1);
+	std::vector<cell> cells = std::vector<cell>(1);
+
+	int iteration = 0;
+	int training_passes;
+	size_t memory_budget;
+
+	// Probability of sampling the learned distribution
+	real fraction = 0.25;
+
+	// Samples a leaf may get in the first pass before it is split, growing
+	// with the square root of the pass length
+	real spatial_threshold = 12000;
+
+	// Share of a quadtree's energy above which a quadrant is subdivided
+	real directional_threshold = 0.01;
+	int max_depth = 20;
+
+	// Fewest quadtree nodes a cell should be able to have, which limits how
+	// far the spatial tree can grow within the memory budget
+	static constexpr size_t MIN_CELL_NODES = 64;
+
+	path_guide(const hittable& world, real t_min, real t_max, int training_passes, size_t memory_budget)
+		: training_passes{training_passes}, memory_budget{memory_budget} {
+		if (!world.bounding_box(t_min, t_max, bounds))
+			bounds = aabb(vec3(-1, -1, -1), vec3(1, 1, 1));
+
+		// A cube, so halving it along each axis in turn keeps cells square
+		const auto extent = bounds.maximum - bounds.minimum;
+		const auto size = std::max({extent.x, extent.y, extent.z}) * real(1.01);
+		const auto center = (bounds.minimum + bounds.maximum) / 2;
+		bounds = aabb(center - vec3(size, size, size) / 2, center + vec3(size, size, size) / 2);
+	}
+
+	bool training() const {
+		return iteration < training_passes;
+	}
+
+	// Quadtree nodes that fit in the budget next to the spatial tree and
+	// the cells themselves
+	size_t node_budget() const {
+		const auto overhead = spatial.size() * sizeof(spatial_node) + cells.size() * sizeof(cell);
+		return std::max<size_t>((memory_budget - std::min(overhead, memory_budget)) / sizeof(quadtree::node), 2 * cells.size());
+	}
+
+	cell& cell_at(const vec3& point) {
+		const auto extent = bounds.maximum - bounds.minimum;
+		vec3 p = (point - bounds.minimum) / extent.x;
+
+		uint32_t n = 0;
+		while (spatial[n].child[0]) {
+			const auto axis = spatial[n].axis;
+			const auto x = std::clamp(p[axis], real(0), real(1));
+			const int side = x >= real(0.5);
+
+			p = vec3(axis == 0 ? 2 * x - side : p.x, axis == 1 ? 2 * x - side : p.y, axis == 2 ? 2 * x - side : p.z);
+			n = spatial[n].child[side];
+		}
+
+		return cells[spatial[n].cell];
+	}
+
+	// Lobe for a diffuse bounce at point. Safe to call from several threads
+	// at once, as long as refine isn't running.
+	guided_lobe lobe(const vec3& point, const vec3& normal) {
+		guided_lobe result(normal);
+		auto& c = cell_at(point);
+
+		if (iteration > 0 && c.learned.total() > 0) {
+			result.fraction = fraction;
+			result.learned = &c.learned;
+		}
+
+		if (training()) {
+			result.building = &c.building;
+
+			#pragma omp atomic
+			c.samples++;
+		}
+
+		return result;
+	}
+
+	// Ends a training pass: splits the cells that got many samples, makes
+	// what was recorded the learned distributions and starts new empty ones
+	void refine() {
+		// A split adds a cell, two spatial nodes and room for two trees
+		const auto cell_bytes = sizeof(cell) + 2 * sizeof(spatial_node) + 2 * MIN_CELL_NODES * sizeof(quadtree::node);
+		const auto max_cells = std::max<size_t>(memory_budget / cell_bytes, 1);
+		const auto threshold = spatial_threshold * std::sqrt(std::pow(real(2), iteration));
+
+		// What was learned is replaced below, so it needn't be copied
+		for (auto& c : cells)
+			c.learned = quadtree();
+
+		std::vector<uint32_t> pending;
+		for (uint32_t n = 0; n < spatial.size(); n++)
+			if (!spatial[n].child[0])
+				pending.push_back(n);
+
+		while (!pending.empty() && cells.size() < max_cells) {
+			const auto n = pending.back();
+			pending.pop_back();
+
+			const auto c = spatial[n].cell;
+			if (cells[c].samples <= threshold)
+				continue;
+
+			// Both halves start from what the whole cell recorded
+			cell half;
+			half.building = cells[c].building;
+			half.samples = cells[c].samples /= 2;
+			cells.push_back(std::move(half));
+
+			spatial_node first, second;
+			first.axis = second.axis = (spatial[n].axis + 1) % 3;
+			first.cell = c;
+			second.cell = cells.size() - 1;
+
+			spatial[n].child[0] = spatial.size();
+			spatial[n].child[1] = spatial.size() + 1;
+			spatial.push_back(first);
+			spatial.push_back(second);
+
+			pending.push_back(spatial[n].child[0]);
+			pending.push_back(spatial[n].child[1]);
+		}
+
+		// Each cell holds two trees. Those of split cells were sized for
+		// fewer cells and are cut down to fit.
+		const auto cell_nodes = std::max<size_t>(node_budget() / (2 * cells.size()), 1);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (size_t k = 0; k < cells.size(); k++) {
+			auto& c = cells[k];
+			c.learned = c.building.pruned(cell_nodes);
+			c.building = c.learned.refined(directional_threshold, max_depth, cell_nodes);
+			c.samples = 0;
+		}
+
+		iteration++;
+	}
+
+	size_t memory() const {
+		size_t bytes = spatial.size() * sizeof(spatial_node) + cells.size() * sizeof(cell);
+		for (const auto& c : cells)
+			bytes += (c.learned.nodes.size() + c.building.nodes.size()) * sizeof(quadtree::node);
+		return bytes;
+	}
+
+	void report(std::ostream& out) const {
+		out << "Path guiding: pass " << iteration << ", " << cells.size() << " cells, "
+		    << memory() / 1024 << " KB\n";
+	}
+};
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "hittable.hpp"
+#include "light_tree.hpp"
+#include "ray.hpp"
+#include "sampler.hpp"
+#include "utils.hpp"
+#include "vec3.hpp"
+
+// Caustics by photon mapping, after Jensen's "Realistic Image Synthesis
+// Using Photon Mapping". Before rendering, photons leave the emitters and
+// are followed through metal and glass; the ones that then land on a diffuse
+// surface are kept. At diffuse hits the light they carried is estimated from
+// the density of the nearest ones. Camera paths leave these paths out, see
+// ray_color, so no light is counted twice.
+//
+// Photons are 20 bytes: the position, the power in Ward's shared exponent
+// format and the incoming direction in two bytes, stored as a balanced kd
+// tree in one array with each node in the middle of its subtree's range.
+
+struct photon {
+	float position[3];
+	uint8_t power[4];
+	uint8_t theta;
+	uint8_t phi;
+	uint8_t axis;
+};
+
+static_assert(sizeof(photon) == 20);
+
+inline void encode_rgbe(const vec3& color, uint8_t rgbe[4]) {
+	const auto largest = std::max({color.x, color.y, color.z});
+	if (largest < real(1e-32)) {
+		std::fill(rgbe, rgbe + 4, 0);
+		return;
+	}
+
+	int exponent;
+	const auto scale = std::frexp(largest, &exponent) * 256 / largest;
+	rgbe[0] = color.x * scale;
+	rgbe[1] = color.y * scale;
+	rgbe[2] = color.z * scale;
+	rgbe[3] = exponent + 128;
+}
+
+inline vec3 decode_rgbe(const uint8_t rgbe[4]) {
+	if (rgbe[3] == 0)
+		return vec3(0, 0, 0);
+
+	const auto scale = std::ldexp(real(1), rgbe[3] - (128 + 8));
+	return vec3(rgbe[0] + real(0.5), rgbe[1] + real(0.5), rgbe[2] + real(0.5)) * scale;
+}
+
+struct photon_map {
+
+	std::vector<photon> photons;
+
+	// Photons a density estimate gathers, and how far it looks for them
+	int neighbours;
+	real max_radius;
+
+	// Paths emitted, and the most that are tried for each photon asked for
+	size_t emitted = 0;
+	static constexpr size_t MAX_PATHS_PER_PHOTON = 100;
+	static constexpr int MAX_BOUNCES = 16;
+	static constexpr size_t BATCH = 1 << 16;
+
+	photon_map(int neighbours, real max_radius) : neighbours{neighbours}, max_radius{max_radius} {}
+
+	bool empty() const {
+		return photons.empty();
+	}
+
+	// Directions are kept as their spherical angles, one byte each
+	static void encode_direction(const vec3& unit_direction, photon& p) {
+		const auto theta = std::acos(std::clamp(unit_direction.z, real(-1), real(1)));
+		auto phi = std::atan2(unit_direction.y, unit_direction.x);
+		if (phi < 0)
+			phi += 2 * PI;
+
+		p.theta = std::min(int(theta * (256 / PI)), 255);
+		p.phi = std::min(int(phi * (256 / (2 * PI))), 255);
+	}
+
+	static vec3 decode_direction(const photon& p) {
+		struct tables {
+			real sin_theta[256], cos_theta[256], sin_phi[256], cos_phi[256];
+
+			tables() {
+				for (int k = 0; k < 256; k++) {
+					const auto angle = (k + real(0.5)) / 256;
+					sin_theta[k] = std::sin(angle * PI);
+					cos_theta[k] = std::cos(angle * PI);
+					sin_phi[k] = std::sin(angle * 2 * PI);
+					cos_phi[k] = std::cos(angle * 2 * PI);
+				}
+			}
+		};
+		static const tables t;
+
+		return vec3(t.sin_theta[p.theta] * t.cos_phi[p.phi], t.sin_theta[p.theta] * t.sin_phi[p.phi], t.cos_theta[p.theta]);
+	}
+
+	// Emits photons from every emitter of the light tree, picked by power,
+	// until `target` of them landed on diffuse surfaces after a specular
+	// bounce, or too many paths were tried for it
+	template<typename Scene>
+	void emit(const Scene& scene, const light_tree& lights, real t_min, real t_max, size_t target) {
+		if (lights.empty())
+			return;
+
+		std::vector<real> cdf;
+		real total = 0;
+		for (const auto& e : lights.emitters)
+			cdf.push_back(total += e.bounds.power);
+
+		struct stored {
+			vec3 position;
+			vec3 direction;
+			vec3 power;
+		};
+
+		std::vector<stored> found;
+
+		while (found.size() < target && emitted < target * MAX_PATHS_PER_PHOTON) {
+			#pragma omp parallel
+			{
+				independent_sampler s;
+				std::vector<stored> local;
+
+				#pragma omp for schedule(dynamic, 256)
+				for (size_t k = 0; k < BATCH; k++) {
+					const auto pick = std::upper_bound(cdf.begin(), cdf.end(), s.get_1d() * total) - cdf.begin();
+					const auto& e = lights.emitters[std::min<size_t>(pick, cdf.size() - 1)];
+					const auto pmf = e.bounds.power / total;
+
+					real u1, u2;
+					s.get_2d(u1, u2);
+
+					const auto time = t_min + s.get_1d() * (t_max - t_min);
+
+					vec3 point, normal;
+					if (!e.object->sample_point(time, u1, u2, point, normal))
+						continue;
+
+					real area, cos_theta;
+					vec3 axis;
+					e.object->emitter_bounds(area, axis, cos_theta);
+
+					// Flat emitters shine from both faces, closed ones outwards
+					real sides = 1;
+					if (cos_theta >= 1) {
+						sides = 2;
+						if (s.get_1d() < 0.5)
+							normal = -normal;
+					}
+
+					s.get_2d(u1, u2);
+					vec3 direction = normal + random_unit_vector(u1, u2);
+					if (direction.zero())
+						direction = normal;
+
+					// Radiance times pi for the cosine lobe times the area
+					const auto radiance = e.object->surface_material()->emitted(0.5, 0.5, point);
+					vec3 power = radiance * (PI * area * sides / pmf);
+
+					ray r(point, direction, time);
+					bool specular = false;
+
+					for (int bounce = 0; bounce < MAX_BOUNCES; bounce++) {
+						hit info;
+						if (!scene.test_hit(r, RAY_T_MIN, INFINITY, info))
+							break;
+
+						if (scene.diffuse(info)) {
+							if (specular)
+								local.push_back({info.point, unit_vector(r.direction), power});
+							break;
+						}
+
+						vec3 attenuation;
+						ray scattered;
+						if (!scene.scatter(r, info, attenuation, scattered, s))
+							break;
+
+						power = power * attenuation;
+						r = scattered;
+						specular = true;
+					}
+				}
+
+				#pragma omp critical
+				found.insert(found.end(), local.begin(), local.end());
+			}
+
+			emitted += BATCH;
+		}
+
+		photons.resize(found.size());
+		for (size_t k = 0; k < found.size(); k++) {
+			auto& p = photons[k];
+			p.position[0] = found[k].position.x;
+			p.position[1] = found[k].position.y;
+			p.position[2] = found[k].position.z;
+			encode_rgbe(found[k].power / emitted, p.power);
+			encode_direction(found[k].direction, p);
+		}
+
+		build(0, photons.size());
+	}
+
+	// Puts the median along the widest axis in the middle of the range
+	void build(size_t begin, size_t end) {
+		if (end - begin <= 1) {
+			if (end > begin)
+				photons[begin].axis = 0;
+			return;
+		}
+
+		float low[3] = {INFINITY, INFINITY, INFINITY};
+		float high[3] = {-INFINITY, -INFINITY, -INFINITY};
+		for (size_t k = begin; k < end; k++)
+			for (int a = 0; a < 3; a++) {
+				low[a] = std::min(low[a], photons[k].position[a]);
+				high[a] = std::max(high[a], photons[k].position[a]);
+			}
+
+		int axis = 0;
+		for (int a = 1; a < 3; a++)
+			if (high[a] - low[a] > high[axis] - low[axis])
+				axis = a;
+
+		const auto middle = begin + (end - begin) / 2;
+		std::nth_element(photons.begin() + begin, photons.begin() + middle, photons.begin() + end,
+			[axis](const photon& a, const photon& b) { return a.position[axis] < b.position[axis]; });
+		photons[middle].axis = axis;
+
+		build(begin, middle);
+		build(middle + 1, end);
+	}
+
+	struct neighbour {
+		float distance_squared;
+		uint32_t index;
+
+		bool operator<(const neighbour& other) const {
+			return distance_squared < other.distance_squared;
+		}
+	};
+
+	// Keeps the closest photons in a max heap, shrinking the search radius
+	// to the farthest of them once there are enough
+	void gather(size_t begin, size_t end, const float point[3], std::vector<neighbour>& heap, float& radius_squared) const {
+		if (begin >= end)
+			return;
+
+		const auto middle = begin + (end - begin) / 2;
+		const auto& p = photons[middle];
+		const auto offset = point[p.axis] - p.position[p.axis];
+
+		if (offset < 0) {
+			gather(begin, middle, point, heap, radius_squared);
+			if (offset * offset < radius_squared)
+				gather(middle + 1, end, point, heap, radius_squared);
+		} else {
+			gather(middle + 1, end, point, heap, radius_squared);
+			if (offset * offset < radius_squared)
+				gather(begin, middle, point, heap, radius_squared);
+		}
+
+		float distance_squared = 0;
+		for (int a = 0; a < 3; a++) {
+			const auto d = point[a] - p.position[a];
+			distance_squared += d * d;
+		}
+
+		if (distance_squared >= radius_squared)
+			return;
+
+		heap.push_back({distance_squared, uint32_t(middle)});
+		std::push_heap(heap.begin(), heap.end());
+
+		if (heap.size() > size_t(neighbours)) {
+			std::pop_heap(heap.begin(), heap.end());
+			heap.pop_back();
+		}
+		if (heap.size() == size_t(neighbours))
+			radius_squared = heap.front().distance_squared;
+	}
+
+	// Light arriving at a diffuse point through caustic paths, spread over
+	// the cosine lobe, so times the albedo it is the reflected radiance.
+	// Photons that came from behind the surface are left out.
+	vec3 radiance(const vec3& point, const vec3& normal) const {
+		if (photons.empty())
+			return vec3(0, 0, 0);
+
+		thread_local std::vector<neighbour> heap;
+		heap.clear();
+
+		const float position[3] = {float(point.x), float(point.y), float(point.z)};
+		float radius_squared = max_radius * max_radius;
+		gather(0, photons.size(), position, heap, radius_squared);
+
+		if (heap.empty())
+			return vec3(0, 0, 0);
+
+		vec3 flux(0, 0, 0);
+		for (const auto& n : heap)
+			if (dot(decode_direction(photons[n.index]), normal) < 0)
+				flux += decode_rgbe(photons[n.index].power);
+
+		const auto area = PI * (heap.size() < size_t(neighbours) ? max_radius * max_radius : radius_squared);
+		return flux / (PI * area);
+	}
+
+	void report(std::ostream& out) const {
+		out << "Caustics: " << photons.size() << " photons from " << emitted << " paths, "
+		    << photons.size() * sizeof(photon) / 1024 << " KB\n";
+	}
+};
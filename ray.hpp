@@ -2,17 +2,25 @@
 
 #include "vec3.hpp"
 
-struct ray {
-	vec3 origin;
-	vec3 direction;
-	double time;
+template<typename T>
+struct ray_t {
+	vec3_t<T> origin;
+	vec3_t<T> direction;
+	T time;
 
-	ray() = default;
-	ray(const vec3& origin, const vec3& direction, double time = 0.0)
+	// Cone around the ray used to pick texture detail: its width at the
+	// origin and how much that grows per unit of distance, in radians
+	T width = 0;
+	T spread = 0;
+
+	ray_t() = default;
+	ray_t(const vec3_t<T>& origin, const vec3_t<T>& direction, T time = 0)
 	    : origin{origin}, direction{direction}, time{time}
 	{}
 
-	vec3 at(float c) const {
+	vec3_t<T> at(T c) const {
 		return origin + c * direction;
 	}
 };
+
+using ray = ray_t<real>;
@@ -6,12 +6,15 @@
 
 struct rect : hittable {
 
-	double k, left, right, down, up;
+	real k, left, right, down, up;
 	std::shared_ptr<material> texture;
 
+	// Axis the rectangle is perpendicular to
+	size_t plane;
+
 	rect() {}
 
-	void assign_corners(double centerw, double centerh, double width, double height) {
+	void assign_corners(real centerw, real centerh, real width, real height) {
 		width /= 2;
 		height /= 2;
 
@@ -22,12 +25,63 @@ struct rect : hittable {
 		up = centerh + height;
 	}
 
-	void calculate_uv(double pointw, double pointh, hit& info) const {
+	void calculate_uv(real pointw, real pointh, hit& info) const {
 		info.u = (pointw - left) / (right - left);
 		info.v = (pointh - down) / (up - down);
 	}
 
-	bool out_of_bounds(const ray& r, double t_min, double t_max, size_t plane, double& hit, vec3& point) const {
+	real uv_extent() const {
+		return std::sqrt((right - left) * (up - down));
+	}
+
+	vec3 plane_normal() const {
+		return vec3(plane == 0, plane == 1, plane == 2);
+	}
+
+	virtual bool emitter_bounds(real& area, vec3& axis, real& cos_theta) const override {
+		area = (right - left) * (up - down);
+		axis = plane_normal();
+		cos_theta = 1;
+		return true;
+	}
+
+	virtual std::shared_ptr<material> surface_material() const override {
+		return texture;
+	}
+
+	// Uniform over the area
+	virtual bool sample_direction(const vec3& origin, real time, real u1, real u2, vec3& direction) const override {
+		auto w = (plane + 1) % 3;
+		auto h = (plane + 2) % 3;
+
+		if (w > h)
+			std::swap(w, h);
+
+		real point[3];
+		point[plane] = k;
+		point[w] = left + u1 * (right - left);
+		point[h] = down + u2 * (up - down);
+
+		direction = vec3(point[0], point[1], point[2]) - origin;
+		return true;
+	}
+
+	virtual bool sample_point(real time, real u1, real u2, vec3& point, vec3& normal) const override {
+		sample_direction(vec3(0, 0, 0), time, u1, u2, point);
+		normal = plane_normal();
+		return true;
+	}
+
+	virtual real direction_pdf(const ray& r, const hit& info) const override {
+		const auto to_light = info.point - r.origin;
+		const auto cosine = std::fabs(dot(unit_vector(to_light), plane_normal()));
+		if (cosine == 0)
+			return 0;
+
+		return to_light.length_squared() / (cosine * (right - left) * (up - down));
+	}
+
+	bool out_of_bounds(const ray& r, real t_min, real t_max, size_t plane, real& hit, vec3& point) const {
 		const auto t = (k - r.origin[plane]) / r.direction[plane];
 
 		if (t < t_min || t_max < t)
@@ -53,23 +107,47 @@ struct rect : hittable {
 
 struct xy_rect : rect {
 
-	xy_rect(vec3 center, double width, double height, std::shared_ptr<material> texture) {
+	xy_rect(vec3 center, real width, real height, std::shared_ptr<material> texture) {
 		this->texture = texture;
+		plane = 2;
 		k = center.z;
 		assign_corners(center.x, center.y, width, height);
 	}
 
-	virtual bool test_hit(const ray& r, double t_min, double t_max, hit& info) const override {
-		if (out_of_bounds(r, t_min, t_max, 2, info.parameter, info.point))
+	virtual bool test_hit(const ray& r, real t_min, real t_max, hit& info) const override {
+		if (!test_intersection(r, t_min, t_max, info))
+			return false;
+
+		complete_hit(r, info);
+		return true;
+	};
+
+	virtual bool test_intersection(const ray& r, real t_min, real t_max, hit& info) const override {
+		vec3 point;
+		if (out_of_bounds(r, t_min, t_max, 2, info.parameter, point))
 			return false;
 
+		info.object = this;
+		return true;
+	}
+
+	virtual void complete_hit(const ray& r, hit& info) const override {
+		info.point = r.at(info.parameter);
+		info.point.z = k;
+		info.point_error = vec3(0, 0, 0);
 		calculate_uv(info.point.x, info.point.y, info);
 		info.face_determination(r, vec3(0, 0, 1));
+		info.footprint_determination(r, uv_extent());
 		info.material_pointer = texture;
-		return true;
-	};
+	}
 
-	virtual bool bounding_box(double t_min, double t_max, aabb& output_box) const override {
+	virtual bool test_occluded(const ray& r, real t_min, real t_max) const override {
+		real t;
+		vec3 point;
+		return !out_of_bounds(r, t_min, t_max, 2, t, point);
+	}
+
+	virtual bool bounding_box(real t_min, real t_max, aabb& output_box) const override {
 		output_box = aabb(vec3(left, down, k - 0.001), vec3(right, up, k + 0.001));
 		return true;
 	};
@@ -77,23 +155,47 @@ struct xy_rect : rect {
 
 struct yz_rect : rect {
 
-	yz_rect(vec3 center, double width, double height, std::shared_ptr<material> texture) {
+	yz_rect(vec3 center, real width, real height, std::shared_ptr<material> texture) {
 		this->texture = texture;
+		plane = 0;
 		k = center.x;
 		assign_corners(center.y, center.z, width, height);
 	}
 
-	virtual bool test_hit(const ray& r, double t_min, double t_max, hit& info) const override {
-		if (out_of_bounds(r, t_min, t_max, 0, info.parameter, info.point))
+	virtual bool test_hit(const ray& r, real t_min, real t_max, hit& info) const override {
+		if (!test_intersection(r, t_min, t_max, info))
+			return false;
+
+		complete_hit(r, info);
+		return true;
+	};
+
+	virtual bool test_intersection(const ray& r, real t_min, real t_max, hit& info) const override {
+		vec3 point;
+		if (out_of_bounds(r, t_min, t_max, 0, info.parameter, point))
 			return false;
 
+		info.object = this;
+		return true;
+	}
+
+	virtual void complete_hit(const ray& r, hit& info) const override {
+		info.point = r.at(info.parameter);
+		info.point.x = k;
+		info.point_error = vec3(0, 0, 0);
 		calculate_uv(info.point.y, info.point.z, info);
 		info.face_determination(r, vec3(1, 0, 0));
+		info.footprint_determination(r, uv_extent());
 		info.material_pointer = texture;
-		return true;
-	};
+	}
+
+	virtual bool test_occluded(const ray& r, real t_min, real t_max) const override {
+		real t;
+		vec3 point;
+		return !out_of_bounds(r, t_min, t_max, 0, t, point);
+	}
 
-	virtual bool bounding_box(double t_min, double t_max, aabb& output_box) const override {
+	virtual bool bounding_box(real t_min, real t_max, aabb& output_box) const override {
 		output_box = aabb(vec3(k - 0.001, left, down), vec3(k + 0.001, right, up));
 		return true;
 	};
@@ -101,23 +203,47 @@ struct yz_rect : rect {
 
 struct xz_rect : rect {
 
-	xz_rect(vec3 center, double width, double height, std::shared_ptr<material> texture) {
+	xz_rect(vec3 center, real width, real height, std::shared_ptr<material> texture) {
 		this->texture = texture;
+		plane = 1;
 		k = center.y;
 		assign_corners(center.x, center.z, width, height);
 	}
 
-	virtual bool test_hit(const ray& r, double t_min, double t_max, hit& info) const override {
-		if (out_of_bounds(r, t_min, t_max, 1, info.parameter, info.point))
+	virtual bool test_hit(const ray& r, real t_min, real t_max, hit& info) const override {
+		if (!test_intersection(r, t_min, t_max, info))
+			return false;
+
+		complete_hit(r, info);
+		return true;
+	};
+
+	virtual bool test_intersection(const ray& r, real t_min, real t_max, hit& info) const override {
+		vec3 point;
+		if (out_of_bounds(r, t_min, t_max, 1, info.parameter, point))
 			return false;
 
+		info.object = this;
+		return true;
+	}
+
+	virtual void complete_hit(const ray& r, hit& info) const override {
+		info.point = r.at(info.parameter);
+		info.point.y = k;
+		info.point_error = vec3(0, 0, 0);
 		calculate_uv(info.point.x, info.point.z, info);
 		info.face_determination(r, vec3(0, 1, 0));
+		info.footprint_determination(r, uv_extent());
 		info.material_pointer = texture;
-		return true;
-	};
+	}
+
+	virtual bool test_occluded(const ray& r, real t_min, real t_max) const override {
+		real t;
+		vec3 point;
+		return !out_of_bounds(r, t_min, t_max, 1, t, point);
+	}
 
-	virtual bool bounding_box(double t_min, double t_max, aabb& output_box) const override {
+	virtual bool bounding_box(real t_min, real t_max, aabb& output_box) const override {
 		output_box = aabb(vec3(left, k - 0.001, down), vec3(right, k + 0.001, up));
 		return true;
 	};
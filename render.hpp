@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cmath>
+
+#include "hittable.hpp"
+#include "light_tree.hpp"
+#include "material.hpp"
+#include "path_guiding.hpp"
+#include "photon_map.hpp"
+#include "ray.hpp"
+#include "sampler.hpp"
+#include "vec3.hpp"
+
+enum class render_mode {
+	path_tracing,
+	ambient_occlusion,
+};
+
+// Auxiliary outputs recorded at the first hit of a camera ray
+struct aov_sample {
+	vec3 albedo;
+	vec3 normal;
+	double depth = 0;
+};
+
+// Scene seen through the virtual hittable and material interfaces. ray_color
+// takes any type with this shape, see static_scene for the closed world one.
+struct dynamic_scene {
+
+	const hittable& world;
+	const light_tree* lights;
+	const photon_map* caustics;
+
+	dynamic_scene(const hittable& world, const light_tree* lights = nullptr, const photon_map* caustics = nullptr)
+	    : world{world}, lights{lights}, caustics{caustics} {}
+
+	bool test_hit(const ray& r, real t_min, real t_max, hit& info) const {
+		return world.test_hit(r, t_min, t_max, info);
+	}
+
+	bool test_occluded(const ray& r, real t_min, real t_max) const {
+		return world.test_occluded(r, t_min, t_max);
+	}
+
+	vec3 emitted(const hit& info) const {
+		return info.material_pointer->emitted(info.u, info.v, info.point);
+	}
+
+	bool scatter(const ray& r, const hit& info, vec3& attenuation, ray& scattered, sampler& s) const {
+		return info.material_pointer->scatter(r, info, attenuation, scattered, s);
+	}
+
+	bool diffuse(const hit& info) const {
+		return info.material_pointer->diffuse();
+	}
+
+	vec3 surface_albedo(const hit& info) const {
+		return info.material_pointer->surface_albedo(info);
+	}
+};
+
+// Diffuse hit a path left from, kept to weigh the emission it finds next
+// against sampling that emitter directly
+struct diffuse_bounce {
+	vec3 point;
+	vec3 normal;
+	real pdf;
+
+	// Weighted emission the bounce found, written by the next hit
+	mutable vec3 emission;
+};
+
+// Weight of a sample with density `pdf` combined with one of density `other`
+inline real power_heuristic(real pdf, real other) {
+	return pdf * pdf / (pdf * pdf + other * other);
+}
+
+// Fraction of the distance to a sampled light left out of its shadow ray, so
+// the light itself doesn't count as an occluder
+constexpr real SHADOW_EPSILON = 1e-4;
+
+// Light reaching a diffuse hit straight from one emitter picked by the light
+// tree, times the albedo over pi and the cosine. Weighted against the lobe
+// the bounce samples from finding the same emitter.
+template<typename Scene>
+vec3 sample_direct_light(const ray& r, const hit& info, const vec3& albedo, const Scene& scene, sampler& s, const guided_lobe& lobe) {
+	real pmf;
+	const auto light = scene.lights->sample(info.point, info.normal, s.get_1d(), pmf);
+
+	real u1, u2;
+	s.get_2d(u1, u2);
+
+	vec3 direction;
+	if (!light || !light->sample_direction(info.point, r.time, u1, u2, direction))
+		return vec3(0, 0, 0);
+
+	const auto cosine = dot(unit_vector(direction), info.normal);
+	if (cosine <= 0)
+		return vec3(0, 0, 0);
+
+	const ray shadow = info.spawn_ray(direction, r.time);
+
+	hit light_hit;
+	if (!light->test_hit(shadow, RAY_T_MIN, INFINITY, light_hit))
+		return vec3(0, 0, 0);
+
+	const auto light_pdf = pmf * light->direction_pdf(shadow, light_hit);
+	if (light_pdf <= 0 || scene.test_occluded(shadow, RAY_T_MIN, light_hit.parameter * (1 - SHADOW_EPSILON)))
+		return vec3(0, 0, 0);
+
+	const auto emitted = light_hit.material_pointer->emitted(light_hit.u, light_hit.v, light_hit.point);
+	const auto brdf = cosine / PI;
+	const auto weight = power_heuristic(light_pdf, lobe.pdf(unit_vector(direction)));
+
+	return emitted * albedo * (brdf * weight / light_pdf);
+}
+
+// Where a path went since its last diffuse hit. Emission found through
+// metal or glass after one is what the photon map estimates, so such paths
+// leave it out when the scene has caustics.
+enum class caustic_state {
+	none,
+	after_diffuse,
+	caustic,
+};
+
+// With a light tree in the scene, diffuse hits also sample an emitter
+// directly and both estimates are combined by multiple importance sampling.
+// With a path guide, diffuse bounces also sample what it learned, and with
+// a photon map they add the caustics it estimates.
+template<typename Scene>
+vec3 ray_color(const ray& r, const vec3& background, const Scene& scene, sampler& s, int depth = 1, aov_sample* first_hit = nullptr, const diffuse_bounce* bounce = nullptr, path_guide* guide = nullptr, caustic_state state = caustic_state::none) {
+	if (depth <= 0)
+		return vec3(0, 0, 0);
+
+	hit info;
+	if (!scene.test_hit(r, RAY_T_MIN, INFINITY, info)) {
+		if (first_hit)
+			first_hit->albedo = background;
+		return background;
+	}
+
+	if (first_hit) {
+		first_hit->albedo = scene.surface_albedo(info);
+		first_hit->normal = info.normal;
+		first_hit->depth = info.parameter * r.direction.length();
+	}
+
+	vec3 emitted = state == caustic_state::caustic ? vec3(0, 0, 0) : scene.emitted(info);
+	if (bounce && !emitted.zero()) {
+		const auto light_pdf = scene.lights->pmf(bounce->point, bounce->normal, info.object);
+		if (light_pdf > 0)
+			emitted *= power_heuristic(bounce->pdf, light_pdf * info.object->direction_pdf(r, info));
+		bounce->emission = emitted;
+	}
+
+	vec3 attenuation;
+	ray scattered;
+
+	if (!scene.scatter(r, info, attenuation, scattered, s))
+		return emitted;
+
+	// The last hit of a path has nothing left to add light to
+	const bool sample_lights = scene.lights && !scene.lights->empty();
+	const bool caustics = scene.caustics && !scene.caustics->empty();
+	if (depth > 1 && (sample_lights || guide || caustics) && scene.diffuse(info)) {
+		const auto lobe = guide ? guide->lobe(info.point, info.normal) : guided_lobe(info.normal);
+		if (guide)
+			lobe.sample(s, scattered.direction);
+
+		const auto direction = unit_vector(scattered.direction);
+		const diffuse_bounce next{info.point, info.normal, lobe.pdf(direction)};
+		const auto next_state = caustics ? caustic_state::after_diffuse : caustic_state::none;
+
+		auto direct = sample_lights ? sample_direct_light(r, info, attenuation, scene, s, lobe) : vec3(0, 0, 0);
+		if (caustics)
+			direct += attenuation * scene.caustics->radiance(info.point, info.normal);
+
+		if (!guide)
+			return emitted + direct + attenuation * ray_color(scattered, background, scene, s, depth - 1, nullptr, sample_lights ? &next : nullptr, nullptr, next_state);
+
+		// Guided directions may point into the surface
+		const auto cosine = dot(direction, info.normal);
+		if (cosine <= 0 || next.pdf <= 0)
+			return emitted + direct;
+
+		// Emitters are left out of what the guide learns when light sampling
+		// finds them anyway, so guided bounces go after indirect light
+		const auto incoming = ray_color(scattered, background, scene, s, depth - 1, nullptr, sample_lights ? &next : nullptr, guide, next_state);
+		lobe.record(direction, incoming - next.emission, next.pdf);
+
+		return emitted + direct + attenuation * incoming * (cosine / PI / next.pdf);
+	}
+
+	const auto next_state = state == caustic_state::none ? caustic_state::none : caustic_state::caustic;
+	return emitted + attenuation * ray_color(scattered, background, scene, s, depth - 1, nullptr, nullptr, guide, next_state);
+}
+
+// Fraction of cosine weighted directions around the first hit that escape
+// within `distance`. Only needs occlusion queries, so it is a cheap preview.
+template<typename Scene>
+vec3 ambient_occlusion(const ray& r, const vec3& background, const Scene& scene, sampler& s, int samples, real distance, aov_sample* first_hit = nullptr) {
+	hit info;
+	if (!scene.test_hit(r, RAY_T_MIN, INFINITY, info)) {
+		if (first_hit)
+			first_hit->albedo = background;
+		return background;
+	}
+
+	if (first_hit) {
+		first_hit->albedo = vec3(1, 1, 1);
+		first_hit->normal = info.normal;
+		first_hit->depth = info.parameter * r.direction.length();
+	}
+
+	int visible = 0;
+	for (int k = 0; k < samples; k++) {
+		real u1, u2;
+		s.get_2d(u1, u2);
+
+		vec3 direction = info.normal + random_unit_vector(u1, u2);
+		if (direction.zero())
+			direction = info.normal;
+
+		const ray probe = info.spawn_ray(direction, r.time);
+		if (!scene.test_occluded(probe, RAY_T_MIN, distance / direction.length()))
+			visible++;
+	}
+
+	return vec3(1, 1, 1) * (double(visible) / samples);
+}
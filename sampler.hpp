@@ -0,0 +1,257 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+#include "utils.hpp"
+
+// A sampler hands out the random numbers of one pixel sample, one dimension
+// at a time. Every call moves on to the next dimension, so the pixel jitter,
+// the lens, the time and each bounce all draw from different dimensions.
+struct sampler {
+	virtual ~sampler() = default;
+
+	// Starts sample `index` of pixel (i, j) and rewinds the dimensions
+	virtual void start_sample(int i, int j, int index) = 0;
+
+	virtual real get_1d() = 0;
+	virtual void get_2d(real& u, real& v) = 0;
+};
+
+// Largest value below 1. Rounding to float can carry numbers just under 1 up
+// to it, which the mappings don't expect.
+constexpr real ONE_MINUS_EPSILON = 1 - std::numeric_limits<real>::epsilon() / 2;
+
+inline real below_one(double x) {
+	return std::min(real(x), ONE_MINUS_EPSILON);
+}
+
+// Bit mixing from MurmurHash3's finalizer
+inline uint32_t hash_mix(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t value) {
+	return hash_mix(seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2)));
+}
+
+inline real uint_to_unit(uint32_t x) {
+	return below_one(x * 0x1p-32);
+}
+
+// Element `i` of a pseudo random permutation of [0, n), no storage needed.
+// From Kensler, "Correlated Multi-Jittered Sampling".
+inline uint32_t permute(uint32_t i, uint32_t n, uint32_t seed) {
+	uint32_t w = n - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+
+	do {
+		i ^= seed;
+		i *= 0xe170893d;
+		i ^= seed >> 16;
+		i ^= (i & w) >> 4;
+		i ^= seed >> 8;
+		i *= 0x0929eb3f;
+		i ^= seed >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | seed >> 27;
+		i *= 0x6935fa69;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3df;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= n);
+
+	return (i + seed) % n;
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+	x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+	x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+	x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+	return x;
+}
+
+struct independent_sampler : sampler {
+
+	virtual void start_sample(int i, int j, int index) override {}
+
+	virtual real get_1d() override {
+		return below_one(random_double());
+	}
+
+	virtual void get_2d(real& u, real& v) override {
+		u = below_one(random_double());
+		v = below_one(random_double());
+	}
+};
+
+// Jittered strata per dimension, with a different shuffle of the strata for
+// every pixel and dimension so dimensions do not line up with each other
+struct stratified_sampler : sampler {
+
+	int samples;
+	int grid;
+	uint32_t pixel_seed = 0;
+	uint32_t index = 0;
+	uint32_t dimension = 0;
+
+	stratified_sampler(int samples) : samples{samples}, grid{std::max(1, (int)std::sqrt(samples))} {}
+
+	virtual void start_sample(int i, int j, int index) override {
+		pixel_seed = hash_combine(hash_mix(i), j);
+		this->index = index;
+		dimension = 0;
+	}
+
+	virtual real get_1d() override {
+		const auto stratum = permute(index % samples, samples, hash_combine(pixel_seed, dimension++));
+		return below_one((stratum + random_double()) / samples);
+	}
+
+	virtual void get_2d(real& u, real& v) override {
+		const uint32_t cells = grid * grid;
+		const auto stratum = permute(index % cells, cells, hash_combine(pixel_seed, dimension++));
+		u = below_one((stratum % grid + random_double()) / grid);
+		v = below_one((stratum / grid + random_double()) / grid);
+	}
+};
+
+// Halton sequence, decorrelated across pixels with a Cranley-Patterson
+// rotation. Dimensions past the prime table fall back to uniform numbers.
+struct halton_sampler : sampler {
+
+	static constexpr int PRIMES = 16;
+	static constexpr uint32_t primes[PRIMES] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53};
+
+	uint32_t pixel_seed = 0;
+	uint32_t index = 0;
+	int dimension = 0;
+
+	virtual void start_sample(int i, int j, int index) override {
+		pixel_seed = hash_combine(hash_mix(i), j);
+		this->index = index;
+		dimension = 0;
+	}
+
+	static double radical_inverse(uint32_t base, uint32_t n) {
+		const double inverse_base = 1.0 / base;
+		double inverse = inverse_base;
+		double result = 0;
+
+		while (n > 0) {
+			result += (n % base) * inverse;
+			n /= base;
+			inverse *= inverse_base;
+		}
+
+		return result;
+	}
+
+	virtual real get_1d() override {
+		if (dimension >= PRIMES)
+			return below_one(random_double());
+
+		const auto offset = hash_combine(pixel_seed, dimension) * 0x1p-32;
+		const auto value = radical_inverse(primes[dimension++], index) + offset;
+		return below_one(value - std::floor(value));
+	}
+
+	virtual void get_2d(real& u, real& v) override {
+		u = get_1d();
+		v = get_1d();
+	}
+};
+
+// Owen scrambled Sobol points, following Burley, "Practical Hash-based Owen
+// Scrambling". Every pair of dimensions takes the first two Sobol dimensions
+// with its own shuffle of the sample order and its own scramble.
+struct sobol_sampler : sampler {
+
+	uint32_t pixel_seed = 0;
+	uint32_t index = 0;
+	uint32_t dimension = 0;
+
+	virtual void start_sample(int i, int j, int index) override {
+		pixel_seed = hash_combine(hash_mix(i), j);
+		this->index = index;
+		dimension = 0;
+	}
+
+	// Owen scrambling of the bits of x, most significant bit first
+	static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+		x = reverse_bits(x);
+		x ^= x * 0x3d20adea;
+		x += seed;
+		x *= (seed >> 16) | 1;
+		x ^= x * 0x05526c56;
+		x ^= x * 0x53a22864;
+		return reverse_bits(x);
+	}
+
+	static uint32_t sobol_first(uint32_t n) {
+		return reverse_bits(n);
+	}
+
+	// Second Sobol dimension, primitive polynomial x + 1
+	static uint32_t sobol_second(uint32_t n) {
+		uint32_t result = 0;
+		uint32_t direction = 1u << 31;
+
+		for (; n; n >>= 1) {
+			if (n & 1)
+				result ^= direction;
+			direction ^= direction >> 1;
+		}
+
+		return result;
+	}
+
+	virtual real get_1d() override {
+		const auto seed = hash_combine(pixel_seed, dimension++);
+		const auto shuffled = nested_uniform_scramble(index, seed);
+		return uint_to_unit(nested_uniform_scramble(sobol_first(shuffled), hash_mix(seed)));
+	}
+
+	virtual void get_2d(real& u, real& v) override {
+		const auto seed = hash_combine(pixel_seed, dimension++);
+		const auto shuffled = nested_uniform_scramble(index, seed);
+		u = uint_to_unit(nested_uniform_scramble(sobol_first(shuffled), hash_combine(seed, 0)));
+		v = uint_to_unit(nested_uniform_scramble(sobol_second(shuffled), hash_combine(seed, 1)));
+	}
+};
+
+enum class sampler_type {
+	independent,
+	stratified,
+	halton,
+	sobol,
+};
+
+inline std::unique_ptr<sampler> make_sampler(sampler_type type, int samples) {
+	switch (type) {
+		case sampler_type::independent: return std::make_unique<independent_sampler>();
+		case sampler_type::stratified: return std::make_unique<stratified_sampler>(samples);
+		case sampler_type::halton: return std::make_unique<halton_sampler>();
+		default:
+		case sampler_type::sobol: return std::make_unique<sobol_sampler>();
+	}
+}
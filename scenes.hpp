@@ -0,0 +1,226 @@
+#pragma once
+
+#include <memory>
+
+#include "arena.hpp"
+#include "hittable_list.hpp"
+#include "material.hpp"
+#include "rectangles.hpp"
+#include "sphere.hpp"
+#include "texture.hpp"
+#include "utils.hpp"
+
+std::shared_ptr<lambertian> make_lambertian(scene_arena& arena, const vec3& color) {
+	return arena.make_material<lambertian>(
+	    arena.make_texture<solid_color>(color));
+}
+
+std::shared_ptr<lambertian> make_checker_material(scene_arena& arena) {
+	return arena.make_material<lambertian>(
+	    arena.make_texture<checker_texture>(
+	        arena.make_texture<solid_color>(vec3(0.2, 0.3, 0.1)),
+	        arena.make_texture<solid_color>(vec3(0.9, 0.9, 0.9))));
+}
+
+std::shared_ptr<lambertian> make_perlin_noise_material(scene_arena& arena, double scale) {
+	return arena.make_material<lambertian>(
+	    arena.make_texture<noise_texture>(scale));
+}
+
+std::shared_ptr<lambertian> make_random_albedo(scene_arena& arena) {
+	return make_lambertian(arena, vec3_random() * vec3_random());
+}
+
+std::shared_ptr<dielectric> make_dielectric(scene_arena& arena) {
+	return arena.make_material<dielectric>(1.5);
+}
+
+std::shared_ptr<diffuse_light> make_light(scene_arena& arena, const vec3& color) {
+	return arena.make_material<diffuse_light>(
+	    arena.make_texture<solid_color>(color));
+}
+
+std::shared_ptr<sphere> make_small_sphere(scene_arena& arena, vec3 center, std::shared_ptr<material> material) {
+	return arena.make_primitive<sphere>(center, 0.2, material);
+}
+
+hittable_list random_scene(scene_arena& arena) {
+	hittable_list scene;
+
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(0, -1000, 0), 1000, make_checker_material(arena)));
+
+	for (int a = -11; a < 11; a++) {
+		for (int b = -11; b < 11; b++) {
+
+			auto material_probability = random_double();
+
+			vec3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+
+			if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
+				if (material_probability < 0.8) {
+					auto moving_sphere = make_small_sphere(arena, center, make_random_albedo(arena));
+					moving_sphere->velocity = vec3(0.0, 0.1, 0.0);
+					scene.objects.push_back(moving_sphere);
+
+				} else if (material_probability < 0.95) {
+					auto albedo = vec3_random(0.5, 1);
+					auto fuzz = random_double(0, 0.5);
+					auto metal_material = arena.make_material<metal>(albedo, fuzz);
+					scene.objects.push_back(make_small_sphere(arena, center, metal_material));
+
+				} else {
+					scene.objects.push_back(make_small_sphere(arena, center, make_dielectric(arena)));
+				}
+			}
+		}
+	}
+
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(0, 1, 0), 1.0, make_dielectric(arena)));
+
+	auto material2 = make_lambertian(arena, vec3(0.4, 0.2, 0.1));
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(-4, 1, 0), 1.0, material2));
+
+	auto material3 = arena.make_material<metal>(vec3(0.7, 0.6, 0.5), 0.0);
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(4, 1, 0), 1.0, material3));
+
+	return scene;
+}
+
+hittable_list two_spheres(scene_arena& arena) {
+	hittable_list scene;
+
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(0, -10, 0), 10, make_checker_material(arena)));
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(0,  10, 0), 10, make_checker_material(arena)));
+
+	return scene;
+}
+
+hittable_list two_perlin_spheres(scene_arena& arena) {
+	hittable_list scene;
+
+	auto material = make_perlin_noise_material(arena, 4);
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(0, -1000, 0), 1000, material));
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(0, 2, 0), 2, material));
+
+	return scene;
+}
+
+hittable_list simple_light(scene_arena& arena) {
+	hittable_list scene;
+
+	auto material = make_perlin_noise_material(arena, 4);
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(0, -1000, 0), 1000, material));
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(0, 2, 0), 2, material));
+
+	auto light = make_light(arena, vec3(4, 4, 4));
+	scene.objects.push_back(arena.make_primitive<xy_rect>(vec3(1.5, 1.5, -2), 2, 2, light));
+
+	return scene;
+}
+
+hittable_list cornell_box(scene_arena& arena) {
+	hittable_list scene;
+
+	auto red = make_lambertian(arena, vec3(.65, .05, .05));
+	auto white = make_lambertian(arena, vec3(.73, .73, .73));
+	auto green = make_lambertian(arena, vec3(.12, .45, .15));
+	auto light = make_light(arena, vec3(15, 15, 15));
+
+	scene.objects.push_back(arena.make_primitive<yz_rect>(vec3(-50,  0, -50), 100, 100, green));
+	scene.objects.push_back(arena.make_primitive<yz_rect>(vec3( 50,  0, -50), 100, 100, red));
+	scene.objects.push_back(arena.make_primitive<xz_rect>(vec3( 0, -50, -50), 100, 100, white));
+	scene.objects.push_back(arena.make_primitive<xz_rect>(vec3( 0,  50, -50), 100, 100, white));
+	scene.objects.push_back(arena.make_primitive<xy_rect>(vec3( 0,  0, -100), 100, 100, white));
+	scene.objects.push_back(arena.make_primitive<xz_rect>(vec3( 0,  49.5, -50), 20, 20, light));
+
+	return scene;
+}
+
+// Expects an equirectangular map of the earth as a PPM in the working directory
+hittable_list earth(scene_arena& arena) {
+	hittable_list scene;
+
+	auto surface = arena.make_material<lambertian>(
+	    arena.make_texture<image_texture>("earthmap.ppm"));
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(0, 0, 0), 30, surface));
+
+	return scene;
+}
+
+// A closed room lit only by a few thousand small lights of varied color and
+// strength, scattered over the floor and along the walls
+hittable_list many_lights(scene_arena& arena) {
+	hittable_list scene;
+
+	auto white = make_lambertian(arena, vec3(.73, .73, .73));
+
+	scene.objects.push_back(arena.make_primitive<yz_rect>(vec3(-50,  0, -50), 100, 100, white));
+	scene.objects.push_back(arena.make_primitive<yz_rect>(vec3( 50,  0, -50), 100, 100, white));
+	scene.objects.push_back(arena.make_primitive<xz_rect>(vec3( 0, -50, -50), 100, 100, white));
+	scene.objects.push_back(arena.make_primitive<xz_rect>(vec3( 0,  50, -50), 100, 100, white));
+	scene.objects.push_back(arena.make_primitive<xy_rect>(vec3( 0,  0, -100), 100, 100, white));
+
+	for (int a = 0; a < 8; a++)
+		for (int b = 0; b < 8; b++) {
+			const vec3 center(-42 + 12 * a, -50 + 4 + 8 * random_double(), -92 + 12 * b);
+			scene.objects.push_back(arena.make_primitive<sphere>(center, 4, make_random_albedo(arena)));
+		}
+
+	for (int k = 0; k < 2000; k++) {
+		const auto strength = 50 * random_double() * random_double();
+		auto light = make_light(arena, strength * vec3_random(0.2, 1));
+
+		if (k % 2) {
+			const vec3 center(random_double(-49, 49), -49.5, random_double(-99, -1));
+			scene.objects.push_back(arena.make_primitive<sphere>(center, 0.3, light));
+		} else {
+			const vec3 center(random_double(-49, 49), random_double(-40, 49), -99.5);
+			scene.objects.push_back(arena.make_primitive<xy_rect>(center, 0.6, 0.6, light));
+		}
+	}
+
+	return scene;
+}
+
+// The cornell box with a glass ball and a mirror ball, which focus the light
+// into caustics on the floor
+hittable_list glass_caustics(scene_arena& arena) {
+	auto scene = cornell_box(arena);
+
+	auto mirror = arena.make_material<metal>(vec3(.9, .9, .9), 0.0);
+
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3(-20, -30, -55), 20, make_dielectric(arena)));
+	scene.objects.push_back(arena.make_primitive<sphere>(vec3( 22, -32, -70), 18, mirror));
+
+	return scene;
+}
+
+constexpr int SCENES = 8;
+
+const char* scene_name(int scene) {
+	switch (scene) {
+		default:
+		case 1: return "random_scene";
+		case 2: return "two_spheres";
+		case 3: return "two_perlin_spheres";
+		case 4: return "simple_light";
+		case 5: return "cornell_box";
+		case 6: return "earth";
+		case 7: return "many_lights";
+		case 8: return "glass_caustics";
+	}
+}
+
+hittable_list choose_scene(int scene, scene_arena& arena) {
+	switch (scene) {
+		default:
+		case 1: return random_scene(arena);
+		case 2: return two_spheres(arena);
+		case 3: return two_perlin_spheres(arena);
+		case 4: return simple_light(arena);
+		case 5: return cornell_box(arena);
+		case 6: return earth(arena);
+		case 7: return many_lights(arena);
+		case 8: return glass_caustics(arena);
+	}
+}
@@ -0,0 +1,386 @@
+// Render server. Keeps every scene it has loaded, with its BVH and light
+// tree, in memory and renders jobs sent over a Unix socket, so a queue of
+// small renders pays for building a scene only once.
+//
+//     g++ -O3 -pthread server.cpp -o server && ./server /tmp/raytracer.sock
+//
+// Clients send one job per line, as key=value fields in any order:
+//
+//     render id=7 scene=5 width=200 height=200 spp=64 crop=0,0,200,200
+//            from=0,0,100 at=0,0,-100 fov=45 aperture=0.1 focus=10
+//
+// Missing fields keep the values above, crop is x0,y0,x1,y1 in pixels from
+// the top left corner and defaults to the whole image. Each finished tile is
+// sent back as the line `tile <id> <x> <y> <width> <height>` followed by its
+// 8 bit RGB pixels, top row first. A job ends with `done <id> <seconds>`, or
+// `error <id> <message>` if it could not start.
+//
+// Tiles of every job go through one pool of threads. Jobs take turns, so a
+// small job sent while a large one renders doesn't wait for it to finish.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "arena.hpp"
+#include "camera.hpp"
+#include "image.hpp"
+#include "light_tree.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scenes.hpp"
+#include "static_scene.hpp"
+#include "view_fields.hpp"
+
+constexpr int MAX_RAY_DEPTH = 2;
+constexpr int TILE_SIZE = 16;
+constexpr sampler_type SAMPLER = sampler_type::sobol;
+
+const vec3 BACKGROUND(0.5, 0.5, 0.5);
+
+// Everything built for a scene, kept until the server exits
+struct resident_scene {
+	scene_arena arena;
+	hittable_list world;
+	std::unique_ptr<light_tree> lights;
+	std::unique_ptr<static_scene> closed_world;
+
+	resident_scene(int id) {
+		world = choose_scene(id, arena);
+		lights = std::make_unique<light_tree>(world, 0, 1);
+		closed_world = std::make_unique<static_scene>(world, 0, 1, lights.get());
+	}
+};
+
+// Scenes by ID. The first job for a scene builds it, later ones wait for
+// that build instead of starting their own. A build that fails is passed on
+// to the jobs waiting for it and forgotten, so the next job tries again.
+struct scene_cache {
+	std::mutex lock;
+	std::map<int, std::shared_future<std::shared_ptr<const resident_scene>>> scenes;
+
+	std::shared_ptr<const resident_scene> get(int id) {
+		std::promise<std::shared_ptr<const resident_scene>> build;
+		std::shared_future<std::shared_ptr<const resident_scene>> scene;
+		bool builder = false;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			const auto found = scenes.find(id);
+			if (found != scenes.end()) {
+				scene = found->second;
+			} else {
+				scene = scenes[id] = build.get_future().share();
+				builder = true;
+			}
+		}
+
+		if (builder) {
+			const auto start = std::chrono::steady_clock::now();
+			try {
+				build.set_value(std::make_shared<const resident_scene>(id));
+			} catch (...) {
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					scenes.erase(id);
+				}
+				build.set_exception(std::current_exception());
+				throw;
+			}
+
+			const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			std::cerr << "Loaded scene " << id << " (" << scene_name(id) << ") in " << elapsed.count() << "s\n";
+		}
+
+		return scene.get();
+	}
+};
+
+// Client socket. Writes from different workers are serialized so messages
+// never interleave, and stop for good once the client goes away.
+struct connection {
+	int fd;
+	std::mutex write_lock;
+	std::atomic<bool> closed{false};
+
+	connection(int fd) : fd{fd} {}
+
+	~connection() {
+		close(fd);
+	}
+
+	void send_message(const std::string& header, const std::string& payload = "") {
+		std::lock_guard<std::mutex> guard(write_lock);
+
+		for (const auto* part : {&header, &payload}) {
+			size_t sent = 0;
+			while (!closed && sent < part->size()) {
+				const auto n = send(fd, part->data() + sent, part->size() - sent, MSG_NOSIGNAL);
+				if (n <= 0)
+					closed = true;
+				else
+					sent += n;
+			}
+		}
+	}
+};
+
+struct render_job {
+	std::string id;
+	std::shared_ptr<connection> client;
+	std::shared_ptr<const resident_scene> scene;
+
+	int width = 200;
+	int height = 200;
+	int samples = 64;
+	int crop[4] = {0, 0, -1, -1};
+
+	vec3 from = vec3(0, 0, 100);
+	vec3 at = vec3(0, 0, -100);
+	real fov = 45;
+	real aperture = 0.1;
+	real focus = 10;
+
+	std::unique_ptr<camera> view;
+	std::chrono::steady_clock::time_point start;
+
+	int tiles_x = 0;
+	int tiles = 0;
+	int next_tile = 0;
+	std::atomic<int> remaining{0};
+
+	void prepare() {
+		if (crop[2] < 0) crop[2] = width;
+		if (crop[3] < 0) crop[3] = height;
+
+		view = std::make_unique<camera>(from, at, vec3(0, 1, 0), fov * PI / 180, real(width) / height, aperture, focus);
+		view->set_image_height(height);
+
+		tiles_x = (crop[2] - crop[0] + TILE_SIZE - 1) / TILE_SIZE;
+		tiles = tiles_x * ((crop[3] - crop[1] + TILE_SIZE - 1) / TILE_SIZE);
+		remaining = tiles;
+		start = std::chrono::steady_clock::now();
+	}
+
+	void render_tile(int tile) {
+		const int x0 = crop[0] + tile % tiles_x * TILE_SIZE;
+		const int y0 = crop[1] + tile / tiles_x * TILE_SIZE;
+		const int x1 = std::min(x0 + TILE_SIZE, crop[2]);
+		const int y1 = std::min(y0 + TILE_SIZE, crop[3]);
+
+		auto pixel_sampler = make_sampler(SAMPLER, samples);
+		sampler& s = *pixel_sampler;
+
+		std::ostringstream pixels;
+
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++) {
+				// Rows count from the bottom in camera space
+				const int i = x;
+				const int j = height - 1 - y;
+
+				vec3 color(0, 0, 0);
+				for (int k = 0; k < samples; k++) {
+					s.start_sample(i, j, k);
+
+					real du, dv;
+					s.get_2d(du, dv);
+
+					const ray r = view->shoot_ray((i + du) / (width - 1), (j + dv) / (height - 1), s);
+					color += ray_color(r, BACKGROUND, *scene->closed_world, s, MAX_RAY_DEPTH);
+				}
+
+				write_color(pixels, color, samples);
+			}
+
+		std::ostringstream header;
+		header << "tile " << id << ' ' << x0 << ' ' << y0 << ' ' << x1 - x0 << ' ' << y1 - y0 << '\n';
+		client->send_message(header.str(), pixels.str());
+
+		if (--remaining == 0) {
+			const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			std::ostringstream done;
+			done << "done " << id << ' ' << elapsed.count() << '\n';
+			client->send_message(done.str());
+		}
+	}
+};
+
+// Workers shared by every job. A worker takes the next tile of the job at
+// the front of the queue and puts that job back at the end.
+struct tile_pool {
+	std::mutex lock;
+	std::condition_variable ready;
+	std::deque<std::shared_ptr<render_job>> jobs;
+	std::vector<std::thread> workers;
+
+	tile_pool(unsigned threads) {
+		for (unsigned t = 0; t < std::max(threads, 1u); t++)
+			workers.emplace_back([this] { work(); });
+	}
+
+	void submit(std::shared_ptr<render_job> job) {
+		if (job->tiles == 0) {
+			job->client->send_message("done " + job->id + " 0\n");
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			jobs.push_back(std::move(job));
+		}
+		ready.notify_all();
+	}
+
+	void work() {
+		while (true) {
+			std::shared_ptr<render_job> job;
+			int tile;
+
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				ready.wait(guard, [&] { return !jobs.empty(); });
+
+				job = jobs.front();
+				jobs.pop_front();
+
+				tile = job->next_tile++;
+				if (job->next_tile < job->tiles && !job->client->closed)
+					jobs.push_back(job);
+			}
+
+			if (!job->client->closed)
+				job->render_tile(tile);
+		}
+	}
+};
+
+// Fills a job from the fields of a `render` line, returns an error message
+// or an empty string
+std::string parse_job(std::istringstream& fields, render_job& job, int& scene) {
+	const auto error = parse_view_fields(fields, job, [&](const std::string& key, const std::string& value, bool& ok) {
+		std::istringstream in(value);
+
+		if (key == "id") job.id = value;
+		else if (key == "scene") ok = bool(in >> scene);
+		else if (key == "crop") {
+			char c;
+			ok = bool(in >> job.crop[0] >> c >> job.crop[1] >> c >> job.crop[2] >> c >> job.crop[3]);
+		}
+		else return false;
+
+		return true;
+	});
+
+	if (!error.empty())
+		return error;
+	if (scene < 1 || scene > SCENES)
+		return "no scene " + std::to_string(scene);
+
+	const int x1 = job.crop[2] < 0 ? job.width : job.crop[2];
+	const int y1 = job.crop[3] < 0 ? job.height : job.crop[3];
+	if (job.crop[0] < 0 || job.crop[1] < 0 || x1 > job.width || y1 > job.height || job.crop[0] > x1 || job.crop[1] > y1)
+		return "crop outside the image";
+
+	return "";
+}
+
+void serve_client(std::shared_ptr<connection> client, scene_cache& scenes, tile_pool& pool) {
+	std::string buffer;
+	char chunk[4096];
+	int jobs = 0;
+
+	while (!client->closed) {
+		const auto n = recv(client->fd, chunk, sizeof(chunk), 0);
+		if (n <= 0)
+			break;
+		buffer.append(chunk, n);
+
+		size_t end;
+		while ((end = buffer.find('\n')) != std::string::npos) {
+			std::istringstream fields(buffer.substr(0, end));
+			buffer.erase(0, end + 1);
+
+			std::string command;
+			if (!(fields >> command))
+				continue;
+
+			auto job = std::make_shared<render_job>();
+			job->id = std::to_string(jobs++);
+			job->client = client;
+
+			if (command != "render") {
+				client->send_message("error " + job->id + " unknown command " + command + '\n');
+				continue;
+			}
+
+			int scene = 5;
+			const auto error = parse_job(fields, *job, scene);
+			if (!error.empty()) {
+				client->send_message("error " + job->id + ' ' + error + '\n');
+				continue;
+			}
+
+			try {
+				job->scene = scenes.get(scene);
+			} catch (const std::exception& e) {
+				client->send_message("error " + job->id + " could not load scene: " + e.what() + '\n');
+				continue;
+			}
+
+			job->prepare();
+			pool.submit(job);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	const char* path = argc > 1 ? argv[1] : "/tmp/raytracer.sock";
+
+	const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (std::strlen(path) >= sizeof(address.sun_path)) {
+		std::cerr << "Socket path too long: " << path << '\n';
+		return 1;
+	}
+	std::strcpy(address.sun_path, path);
+
+	unlink(path);
+	if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listener, 16) < 0) {
+		std::perror("Could not listen");
+		return 1;
+	}
+
+	scene_cache scenes;
+	tile_pool pool(std::thread::hardware_concurrency());
+
+	std::cerr << "Listening on " << path << " with " << pool.workers.size() << " threads\n";
+
+	while (true) {
+		const int fd = accept(listener, nullptr, nullptr);
+		if (fd < 0)
+			continue;
+
+		std::thread(serve_client, std::make_shared<connection>(fd), std::ref(scenes), std::ref(pool)).detach();
+	}
+}
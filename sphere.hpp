@@ -10,24 +10,27 @@ struct sphere : hittable {
 	
 	vec3 center;
 	vec3 velocity;
-	double radius;
+	real radius;
 	std::shared_ptr<material> material_pointer;
 
 	sphere() = default;
-	sphere(const vec3& center, double radius, std::shared_ptr<material> material_pointer)
+	sphere(const vec3& center, real radius, std::shared_ptr<material> material_pointer)
 	    : center{center}, radius{radius}, material_pointer{material_pointer} {
 		velocity = vec3(0, 0, 0);
 	}
 
-	static void get_sphere_uv(const vec3& p, double& u, double& v) {
-		auto theta = acos(-p.y);
-		auto phi = atan2(-p.z, p.x) + M_PI;
+	static void get_sphere_uv(const vec3& p, real& u, real& v) {
+		auto theta = std::acos(-p.y);
+		auto phi = std::atan2(-p.z, p.x) + PI;
 
-		u = phi / (2 * M_PI);
-		v = theta / M_PI;
+		u = phi / (2 * PI);
+		v = theta / PI;
 	}
 
-	virtual bool test_hit(const ray& r, double t_min, double t_max, hit& info) const override {
+	// Both intersections of the ray's line with the sphere, t0 <= t1.
+	// Follows Haines et al., "Precision Improvements for Ray/Sphere
+	// Intersection", so large or distant spheres stay accurate in float.
+	bool intersect_line(const ray& r, real& t0, real& t1) const {
 
 		const auto current_center = center + r.time * velocity;
 
@@ -38,31 +41,133 @@ struct sphere : hittable {
 		const auto hb = dot(r.direction, distance);
 		const auto c = distance.length_squared() - radius * radius;
 
-		const auto discriminant = hb * hb - a * c;
-		
+		// Squared distance from the center to the line, instead of hb^2 - ac
+		const auto to_line = distance - (hb / a) * r.direction;
+		const auto discriminant = a * (radius * radius - to_line.length_squared());
+
 		if (discriminant < 0)
 			return false;
 
-		const auto discriminant_sqrt = std::sqrt(discriminant);
+		const auto q = -hb - std::copysign(std::sqrt(discriminant), hb);
+
+		t0 = c / q;
+		t1 = q / a;
+
+		if (t0 > t1)
+			std::swap(t0, t1);
+
+		return true;
+	}
+
+	virtual bool test_hit(const ray& r, real t_min, real t_max, hit& info) const override {
+		if (!test_intersection(r, t_min, t_max, info))
+			return false;
+
+		complete_hit(r, info);
+		return true;
+	}
+
+	virtual bool test_intersection(const ray& r, real t_min, real t_max, hit& info) const override {
+		real t0, t1;
+		if (!intersect_line(r, t0, t1))
+			return false;
 
-		auto root = (-hb - discriminant_sqrt) / a;
+		auto root = t0;
 		if (root < t_min || t_max < root) {
-			root = (-hb + discriminant_sqrt) / a;
+			root = t1;
 			if (root < t_min || t_max < root)
 				return false;
 		}
 
 		info.parameter = root;
-		info.point = r.at(info.parameter);
-		vec3 out_normal = unit_vector(info.point - current_center);
+		info.object = this;
+
+		return true;
+	}
+
+	virtual void complete_hit(const ray& r, hit& info) const override {
+		const auto current_center = center + r.time * velocity;
+
+		vec3 out_normal = (r.at(info.parameter) - current_center) / radius;
+
+		// Reprojecting onto the surface leaves only rounding error in the point
+		out_normal /= out_normal.length();
+		info.point = current_center + radius * out_normal;
+		info.point_error = gamma_bound<real>(5) * (vec3_abs(current_center) + vec3_abs(radius * out_normal));
+
 		info.face_determination(r, out_normal);
 		get_sphere_uv(out_normal, info.u, info.v);
+
+		// u runs around the equator and v from pole to pole
+		info.footprint_determination(r, std::sqrt(real(2)) * PI * radius);
 		info.material_pointer = material_pointer;
-		
+	}
+
+	virtual bool test_occluded(const ray& r, real t_min, real t_max) const override {
+		real t0, t1;
+		if (!intersect_line(r, t0, t1))
+			return false;
+
+		return (t_min <= t0 && t0 <= t_max) || (t_min <= t1 && t1 <= t_max);
+	}
+
+	virtual bool emitter_bounds(real& area, vec3& axis, real& cos_theta) const override {
+		area = 4 * PI * radius * radius;
+		axis = vec3(0, 0, 1);
+		cos_theta = -1;
 		return true;
 	}
 
-	virtual bool bounding_box(double t_min, double t_max, aabb& output_box) const override {
+	virtual std::shared_ptr<material> surface_material() const override {
+		return material_pointer;
+	}
+
+	// 1 - cos of the half angle of the cone the sphere fills seen from
+	// `origin`, or 0 from inside it
+	real cone_solid_fraction(const vec3& origin, real time) const {
+		const auto distance_squared = (center + time * velocity - origin).length_squared();
+		if (distance_squared <= radius * radius)
+			return 0;
+
+		const auto sin_squared = radius * radius / distance_squared;
+		return sin_squared / (1 + std::sqrt(1 - sin_squared));
+	}
+
+	// Uniform over the cone of directions that see the sphere
+	virtual bool sample_direction(const vec3& origin, real time, real u1, real u2, vec3& direction) const override {
+		const auto one_minus_cos_max = cone_solid_fraction(origin, time);
+		if (one_minus_cos_max <= 0)
+			return false;
+
+		const auto w = unit_vector(center + time * velocity - origin);
+		const auto a = std::fabs(w.x) > real(0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+		const auto v = unit_vector(cross(w, a));
+		const auto u = cross(w, v);
+
+		const auto cos_theta = 1 - u1 * one_minus_cos_max;
+		const auto sin_theta = std::sqrt(std::max(real(0), 1 - cos_theta * cos_theta));
+		const auto phi = 2 * PI * u2;
+
+		direction = cos_theta * w + sin_theta * (std::cos(phi) * u + std::sin(phi) * v);
+		return true;
+	}
+
+	virtual vec3 motion() const override {
+		return velocity;
+	}
+
+	virtual bool sample_point(real time, real u1, real u2, vec3& point, vec3& normal) const override {
+		normal = random_unit_vector(u1, u2);
+		point = center + time * velocity + radius * normal;
+		return true;
+	}
+
+	virtual real direction_pdf(const ray& r, const hit& info) const override {
+		const auto one_minus_cos_max = cone_solid_fraction(r.origin, r.time);
+		return one_minus_cos_max > 0 ? 1 / (2 * PI * one_minus_cos_max) : 0;
+	}
+
+	virtual bool bounding_box(real t_min, real t_max, aabb& output_box) const override {
 
 		const auto first_center = center + t_min * velocity;
 		const auto second_center = center + t_max * velocity;
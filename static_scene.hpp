@@ -0,0 +1,470 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <typeinfo>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "aabb.hpp"
+#include "grid.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "light_tree.hpp"
+#include "material.hpp"
+#include "photon_map.hpp"
+#include "rectangles.hpp"
+#include "sampler.hpp"
+#include "sphere.hpp"
+
+// Closed world version of a scene. The built-in primitives and materials are
+// copied by value into variants and called without going through the vtable,
+// so the compiler can inline them into traversal and shading. Anything else
+// is kept behind its shared pointer and still goes through the virtual calls.
+//
+// Rays find the primitives through a flattened BVH, or through a uniform
+// grid once select(accelerator::grid) built one.
+
+enum class accelerator {
+	bvh,
+	grid,
+};
+
+using primitive_variant = std::variant<sphere, xy_rect, yz_rect, xz_rect, std::shared_ptr<hittable>>;
+using material_variant = std::variant<lambertian, metal, dielectric, diffuse_light, std::shared_ptr<material>>;
+
+// Qualified calls are bound at compile time
+template<typename T>
+inline bool primitive_test_intersection(const T& p, const ray& r, real t_min, real t_max, hit& info) {
+	return p.T::test_intersection(r, t_min, t_max, info);
+}
+
+inline bool primitive_test_intersection(const std::shared_ptr<hittable>& p, const ray& r, real t_min, real t_max, hit& info) {
+	return p->test_intersection(r, t_min, t_max, info);
+}
+
+template<typename T>
+inline void primitive_complete_hit(const T& p, const ray& r, hit& info) {
+	p.T::complete_hit(r, info);
+}
+
+inline void primitive_complete_hit(const std::shared_ptr<hittable>& p, const ray& r, hit& info) {
+	finish_hit(r, info);
+}
+
+template<typename T>
+inline bool primitive_test_occluded(const T& p, const ray& r, real t_min, real t_max) {
+	return p.T::test_occluded(r, t_min, t_max);
+}
+
+inline bool primitive_test_occluded(const std::shared_ptr<hittable>& p, const ray& r, real t_min, real t_max) {
+	return p->test_occluded(r, t_min, t_max);
+}
+
+template<typename T>
+inline vec3 material_emitted(const T& m, const hit& info) {
+	return m.T::emitted(info.u, info.v, info.point);
+}
+
+inline vec3 material_emitted(const std::shared_ptr<material>& m, const hit& info) {
+	return m->emitted(info.u, info.v, info.point);
+}
+
+template<typename T>
+inline bool material_scatter(const T& m, const ray& r, const hit& info, vec3& attenuation, ray& scattered, sampler& s) {
+	return m.T::scatter(r, info, attenuation, scattered, s);
+}
+
+inline bool material_scatter(const std::shared_ptr<material>& m, const ray& r, const hit& info, vec3& attenuation, ray& scattered, sampler& s) {
+	return m->scatter(r, info, attenuation, scattered, s);
+}
+
+template<typename T>
+inline bool material_diffuse(const T& m) {
+	return m.T::diffuse();
+}
+
+inline bool material_diffuse(const std::shared_ptr<material>& m) {
+	return m->diffuse();
+}
+
+template<typename T>
+inline vec3 material_surface_albedo(const T& m, const hit& info) {
+	return m.T::surface_albedo(info);
+}
+
+inline vec3 material_surface_albedo(const std::shared_ptr<material>& m, const hit& info) {
+	return m->surface_albedo(info);
+}
+
+struct static_scene {
+
+	// Material of primitives that were not unpacked, their hit record
+	// carries the material pointer instead
+	static constexpr uint32_t DYNAMIC_MATERIAL = UINT32_MAX;
+
+	static constexpr size_t LEAF_SIZE = 2;
+
+	// Flattened BVH in depth first order. An inner node's first child is
+	// right after it, `offset` is its second child. Leaves hold `count`
+	// primitives starting at `offset`.
+	struct node {
+		aabb box;
+		uint32_t offset;
+		uint16_t count;
+		uint16_t axis;
+	};
+
+	std::vector<primitive_variant> primitives;
+	std::vector<uint32_t> primitive_materials;
+	std::vector<material_variant> materials;
+	std::vector<node> nodes;
+
+	// Bounds of the primitives, in their order, from which the grid is built
+	std::vector<aabb> primitive_boxes;
+
+	accelerator structure = accelerator::bvh;
+	uniform_grid grid;
+
+	// Objects the primitives were copied from, hits report these so they
+	// can be looked up in the light tree
+	std::vector<const hittable*> originals;
+
+	const light_tree* lights;
+
+	// Set once the photon map has been traced through this scene
+	const photon_map* caustics = nullptr;
+
+	static_scene(const hittable_list& list, real t_min, real t_max, const light_tree* lights = nullptr) : lights{lights} {
+		std::unordered_map<const material*, uint32_t> material_indices;
+
+		std::vector<primitive_variant> unordered_primitives;
+		std::vector<uint32_t> unordered_materials;
+		std::vector<aabb> boxes;
+
+		for (const auto& object : list.objects) {
+			aabb box;
+			if (!object->bounding_box(t_min, t_max, box))
+				std::cerr << "No bounding box in static_scene constructor.\n";
+
+			boxes.push_back(box);
+			unordered_primitives.push_back(unpack_primitive(object));
+
+			const auto m = std::visit([](const auto& p) { return material_pointer_of(p); }, unordered_primitives.back());
+			unordered_materials.push_back(m ? intern_material(m, material_indices) : DYNAMIC_MATERIAL);
+		}
+
+		std::vector<uint32_t> order(boxes.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = i;
+
+		if (!order.empty())
+			build(boxes, order, 0, order.size());
+
+		for (const auto i : order) {
+			primitives.push_back(unordered_primitives[i]);
+			primitive_materials.push_back(unordered_materials[i]);
+			originals.push_back(list.objects[i].get());
+			primitive_boxes.push_back(boxes[i]);
+		}
+	}
+
+	// Switches what rays are traced through, building the grid the first
+	// time it is asked for
+	void select(accelerator a) {
+		structure = a;
+		if (a == accelerator::grid && grid.empty())
+			grid = uniform_grid(primitive_boxes);
+	}
+
+	static primitive_variant unpack_primitive(const std::shared_ptr<hittable>& object) {
+		const auto& type = typeid(*object);
+
+		if (type == typeid(sphere))
+			return static_cast<const sphere&>(*object);
+		if (type == typeid(xy_rect))
+			return static_cast<const xy_rect&>(*object);
+		if (type == typeid(yz_rect))
+			return static_cast<const yz_rect&>(*object);
+		if (type == typeid(xz_rect))
+			return static_cast<const xz_rect&>(*object);
+
+		return object;
+	}
+
+	static std::shared_ptr<material> material_pointer_of(const sphere& p) {
+		return p.material_pointer;
+	}
+
+	static std::shared_ptr<material> material_pointer_of(const rect& p) {
+		return p.texture;
+	}
+
+	static std::shared_ptr<material> material_pointer_of(const std::shared_ptr<hittable>& p) {
+		return nullptr;
+	}
+
+	uint32_t intern_material(const std::shared_ptr<material>& m, std::unordered_map<const material*, uint32_t>& indices) {
+		const auto found = indices.find(m.get());
+		if (found != indices.end())
+			return found->second;
+
+		const auto& type = typeid(*m);
+
+		if (type == typeid(lambertian))
+			materials.push_back(static_cast<const lambertian&>(*m));
+		else if (type == typeid(metal))
+			materials.push_back(static_cast<const metal&>(*m));
+		else if (type == typeid(dielectric))
+			materials.push_back(static_cast<const dielectric&>(*m));
+		else if (type == typeid(diffuse_light))
+			materials.push_back(static_cast<const diffuse_light&>(*m));
+		else
+			materials.push_back(m);
+
+		return indices[m.get()] = materials.size() - 1;
+	}
+
+	// Median split on the longest axis of the primitive centroids
+	uint32_t build(const std::vector<aabb>& boxes, std::vector<uint32_t>& order, size_t start, size_t end) {
+		const uint32_t index = nodes.size();
+		nodes.emplace_back();
+
+		aabb box = boxes[order[start]];
+		aabb centroids(centroid(box), centroid(box));
+
+		for (size_t i = start + 1; i < end; i++) {
+			box = surrounding_box(box, boxes[order[i]]);
+			const auto c = centroid(boxes[order[i]]);
+			centroids = surrounding_box(centroids, aabb(c, c));
+		}
+
+		nodes[index].box = box;
+
+		if (end - start <= LEAF_SIZE) {
+			nodes[index].offset = start;
+			nodes[index].count = end - start;
+			nodes[index].axis = 0;
+			return index;
+		}
+
+		const auto extent = centroids.maximum - centroids.minimum;
+		const int axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+
+		const auto mid = (start + end) / 2;
+		std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+			[&](uint32_t a, uint32_t b) { return centroid(boxes[a])[axis] < centroid(boxes[b])[axis]; });
+
+		build(boxes, order, start, mid);
+		const auto second = build(boxes, order, mid, end);
+
+		nodes[index].offset = second;
+		nodes[index].count = 0;
+		nodes[index].axis = axis;
+
+		return index;
+	}
+
+	static vec3 centroid(const aabb& box) {
+		return 0.5 * (box.minimum + box.maximum);
+	}
+
+	// Fills in the rest of the hit record once the closest primitive is known
+	void complete_hit(uint32_t closest, const ray& r, hit& info) const {
+		std::visit([&](const auto& p) { primitive_complete_hit(p, r, info); }, primitives[closest]);
+		info.material_index = primitive_materials[closest];
+		info.object = originals[closest];
+	}
+
+	bool test_hit(const ray& r, real t_min, real t_max, hit& info) const {
+		if (structure == accelerator::grid)
+			return test_hit_grid(r, t_min, t_max, info);
+
+		if (nodes.empty())
+			return false;
+
+		const bool negative[3] = {r.direction.x < 0, r.direction.y < 0, r.direction.z < 0};
+
+		uint32_t stack[64];
+		int top = 0;
+		uint32_t current = 0;
+		uint32_t closest = 0;
+		bool hit_anything = false;
+
+		while (true) {
+			const node& n = nodes[current];
+
+			if (n.box.hit(r, t_min, t_max)) {
+				if (n.count) {
+					for (uint32_t i = n.offset; i < n.offset + n.count; i++) {
+						const auto hit_primitive = std::visit(
+							[&](const auto& p) { return primitive_test_intersection(p, r, t_min, t_max, info); },
+							primitives[i]);
+
+						if (hit_primitive) {
+							hit_anything = true;
+							t_max = info.parameter;
+							closest = i;
+						}
+					}
+
+					if (!top)
+						break;
+					current = stack[--top];
+
+				} else if (negative[n.axis]) {
+					stack[top++] = current + 1;
+					current = n.offset;
+
+				} else {
+					stack[top++] = n.offset;
+					current = current + 1;
+				}
+
+			} else {
+				if (!top)
+					break;
+				current = stack[--top];
+			}
+		}
+
+		if (!hit_anything)
+			return false;
+
+		complete_hit(closest, r, info);
+		return true;
+	}
+
+	// Large primitives first, then the cells along the ray
+	bool test_hit_grid(const ray& r, real t_min, real t_max, hit& info) const {
+		uint32_t closest = 0;
+		bool hit_anything = false;
+
+		const auto test = [&](uint32_t i) {
+			const auto hit_primitive = std::visit(
+				[&](const auto& p) { return primitive_test_intersection(p, r, t_min, t_max, info); },
+				primitives[i]);
+
+			if (hit_primitive) {
+				hit_anything = true;
+				t_max = info.parameter;
+				closest = i;
+			}
+		};
+
+		for (const auto i : grid.large)
+			test(i);
+
+		auto& tested = thread_mailbox();
+		tested.start(primitives.size());
+
+		grid.walk(r, t_min, t_max, [&](const uint32_t* begin, const uint32_t* end) {
+			for (auto i = begin; i != end; i++)
+				if (tested.first_visit(*i))
+					test(*i);
+			return false;
+		});
+
+		if (!hit_anything)
+			return false;
+
+		complete_hit(closest, r, info);
+		return true;
+	}
+
+	bool test_occluded_grid(const ray& r, real t_min, real t_max) const {
+		const auto occluded = [&](uint32_t i) {
+			return std::visit([&](const auto& p) { return primitive_test_occluded(p, r, t_min, t_max); }, primitives[i]);
+		};
+
+		for (const auto i : grid.large)
+			if (occluded(i))
+				return true;
+
+		auto& tested = thread_mailbox();
+		tested.start(primitives.size());
+
+		bool found = false;
+		grid.walk(r, t_min, t_max, [&](const uint32_t* begin, const uint32_t* end) {
+			for (auto i = begin; i != end; i++)
+				if (tested.first_visit(*i) && occluded(*i))
+					return found = true;
+			return false;
+		});
+
+		return found;
+	}
+
+	bool test_occluded(const ray& r, real t_min, real t_max) const {
+		if (structure == accelerator::grid)
+			return test_occluded_grid(r, t_min, t_max);
+
+		if (nodes.empty())
+			return false;
+
+		uint32_t stack[64];
+		int top = 0;
+		uint32_t current = 0;
+
+		while (true) {
+			const node& n = nodes[current];
+
+			if (n.box.hit(r, t_min, t_max)) {
+				if (n.count) {
+					for (uint32_t i = n.offset; i < n.offset + n.count; i++) {
+						const auto occluded = std::visit(
+							[&](const auto& p) { return primitive_test_occluded(p, r, t_min, t_max); },
+							primitives[i]);
+
+						if (occluded)
+							return true;
+					}
+
+					if (!top)
+						return false;
+					current = stack[--top];
+
+				} else {
+					stack[top++] = n.offset;
+					current = current + 1;
+				}
+
+			} else {
+				if (!top)
+					return false;
+				current = stack[--top];
+			}
+		}
+	}
+
+	vec3 emitted(const hit& info) const {
+		if (info.material_index == DYNAMIC_MATERIAL)
+			return info.material_pointer->emitted(info.u, info.v, info.point);
+
+		return std::visit([&](const auto& m) { return material_emitted(m, info); }, materials[info.material_index]);
+	}
+
+	bool scatter(const ray& r, const hit& info, vec3& attenuation, ray& scattered, sampler& s) const {
+		if (info.material_index == DYNAMIC_MATERIAL)
+			return info.material_pointer->scatter(r, info, attenuation, scattered, s);
+
+		return std::visit([&](const auto& m) { return material_scatter(m, r, info, attenuation, scattered, s); }, materials[info.material_index]);
+	}
+
+	bool diffuse(const hit& info) const {
+		if (info.material_index == DYNAMIC_MATERIAL)
+			return info.material_pointer->diffuse();
+
+		return std::visit([&](const auto& m) { return material_diffuse(m); }, materials[info.material_index]);
+	}
+
+	vec3 surface_albedo(const hit& info) const {
+		if (info.material_index == DYNAMIC_MATERIAL)
+			return info.material_pointer->surface_albedo(info);
+
+		return std::visit([&](const auto& m) { return material_surface_albedo(m, info); }, materials[info.material_index]);
+	}
+};
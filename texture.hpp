@@ -3,10 +3,17 @@
 #include <memory>
 
 #include "perlin.hpp"
+#include "texture_cache.hpp"
 #include "utils.hpp"
 
 struct texture {
-	virtual vec3 value(double u, double v, const vec3& p) const = 0;
+	virtual vec3 value(real u, real v, const vec3& p) const = 0;
+
+	// Value averaged over a footprint `width` wide in uv space, see
+	// hit::footprint. Only prefiltered textures make use of it.
+	virtual vec3 filtered_value(real u, real v, const vec3& p, real width) const {
+		return value(u, v, p);
+	}
 };
 
 struct solid_color : texture {
@@ -16,10 +23,10 @@ struct solid_color : texture {
 	solid_color() {}
 	solid_color(const vec3& c) : color{c} {}
 
-	solid_color(double red, double green, double blue)
+	solid_color(real red, real green, real blue)
 	    : solid_color(vec3(red, green, blue)) {}
 
-	virtual vec3 value(double u, double v, const vec3& p) const override {
+	virtual vec3 value(real u, real v, const vec3& p) const override {
 		return color;
 	}
 };
@@ -35,22 +42,53 @@ struct checker_texture : texture {
 	checker_texture(const vec3& even_color, const vec3& odd_color)
 	    : even{std::make_shared<solid_color>(even_color)}, odd{std::make_shared<solid_color>(odd_color)} {}
 
-	virtual vec3 value(double u, double v, const vec3& p) const override {
+	virtual vec3 value(real u, real v, const vec3& p) const override {
 
 		auto sines = sin(10 * p.x) * sin(10 * p.y) * sin(10 * p.z);
 
 		return (sines < 0 ? odd : even)->value(u, v, p);
 	}
+
+	virtual vec3 filtered_value(real u, real v, const vec3& p, real width) const override {
+
+		auto sines = sin(10 * p.x) * sin(10 * p.y) * sin(10 * p.z);
+
+		return (sines < 0 ? odd : even)->filtered_value(u, v, p, width);
+	}
 };
 
 struct noise_texture : texture {
 
 	perlin noise;
-	double scale;
+	real scale;
 
-	noise_texture(double scale = 1) : scale{scale} {}
+	noise_texture(real scale = 1) : scale{scale} {}
 
-	virtual vec3 value(double u, double v, const vec3& p) const override {
+	virtual vec3 value(real u, real v, const vec3& p) const override {
 		return vec3(1, 1, 1) * 0.5 * (1 + noise.at(scale * p));
 	}
 };
+
+// Image mapped over uv, read from a PPM file through the shared texture cache
+struct image_texture : texture {
+
+	std::unique_ptr<tiled_image> image;
+
+	image_texture(const char* path, texture_tile_cache& cache = shared_texture_cache())
+	    : image{tiled_image::open_ppm(path, cache)} {
+		if (!image)
+			std::cerr << "Could not load texture image " << path << ".\n";
+	}
+
+	virtual vec3 value(real u, real v, const vec3& p) const override {
+		return filtered_value(u, v, p, 0);
+	}
+
+	virtual vec3 filtered_value(real u, real v, const vec3& p, real width) const override {
+		// Cyan makes a missing image easy to spot
+		if (!image)
+			return vec3(0, 1, 1);
+
+		return image->trilinear(u, 1 - v, width);
+	}
+};
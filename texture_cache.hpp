@@ -0,0 +1,393 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.hpp"
+#include "vec3.hpp"
+
+// Image textures are converted once into a tiled, mipmapped file next to the
+// source image. Texels are 8 bit RGBA in square tiles of exactly one page,
+// so a tile can be mapped in and dropped again on its own. Lookups go
+// through texture_tile_cache, which bounds how many tiles stay in memory.
+
+constexpr int TEXTURE_TILE_SIZE = 32;
+constexpr size_t TEXTURE_TILE_BYTES = TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 4;
+constexpr int TEXTURE_MAX_LEVELS = 24;
+
+struct tiled_texture_header {
+
+	struct level {
+		uint32_t width;
+		uint32_t height;
+		uint32_t tiles_x;
+		uint32_t tiles_y;
+		uint64_t offset;
+	};
+
+	char magic[8];
+	uint32_t levels;
+	level level_info[TEXTURE_MAX_LEVELS];
+};
+
+static_assert(sizeof(tiled_texture_header) <= TEXTURE_TILE_BYTES);
+
+constexpr char TILED_TEXTURE_MAGIC[8] = "RTTILES";
+
+struct texture_tile {
+	uint8_t texels[TEXTURE_TILE_BYTES];
+};
+
+// Least recently used set of decoded tiles, shared by every image texture.
+// It is split in shards with a lock each, so threads rarely wait on each
+// other. Tiles are handed out as shared pointers: one evicted while a thread
+// still reads it stays alive until that thread lets go.
+struct texture_tile_cache {
+
+	static constexpr int SHARDS = 64;
+
+	struct shard {
+		std::mutex lock;
+		std::list<std::pair<uint64_t, std::shared_ptr<const texture_tile>>> recent;
+		std::unordered_map<uint64_t, decltype(recent)::iterator> index;
+	};
+
+	// Memory cap for all resident tiles, in bytes
+	size_t capacity;
+
+	shard shards[SHARDS];
+
+	std::atomic<uint32_t> textures{0};
+	std::atomic<uint64_t> hits{0};
+	std::atomic<uint64_t> misses{0};
+	std::atomic<uint64_t> evictions{0};
+	std::atomic<size_t> resident{0};
+	std::atomic<size_t> peak{0};
+
+	texture_tile_cache(size_t capacity) : capacity{capacity} {}
+
+	uint32_t register_texture() {
+		return textures++;
+	}
+
+	static uint64_t tile_key(uint32_t texture, int level, uint32_t x, uint32_t y) {
+		return uint64_t(texture) << 48 | uint64_t(level) << 40 | uint64_t(x) << 20 | y;
+	}
+
+	// Returns the tile for `key`, calling load(tile) to fill it on a miss
+	template<typename Loader>
+	std::shared_ptr<const texture_tile> fetch(uint64_t key, Loader&& load) {
+		shard& s = shards[(key * 0x9e3779b97f4a7c15ull) >> 58];
+		std::lock_guard<std::mutex> guard(s.lock);
+
+		const auto found = s.index.find(key);
+		if (found != s.index.end()) {
+			hits.fetch_add(1, std::memory_order_relaxed);
+			s.recent.splice(s.recent.begin(), s.recent, found->second);
+			return found->second->second;
+		}
+
+		misses.fetch_add(1, std::memory_order_relaxed);
+
+		auto tile = std::make_shared<texture_tile>();
+		load(*tile);
+
+		const size_t shard_capacity = std::max(capacity / SHARDS, TEXTURE_TILE_BYTES);
+		while (!s.recent.empty() && (s.index.size() + 1) * TEXTURE_TILE_BYTES > shard_capacity) {
+			s.index.erase(s.recent.back().first);
+			s.recent.pop_back();
+			resident -= TEXTURE_TILE_BYTES;
+			evictions.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		s.recent.emplace_front(key, tile);
+		s.index[key] = s.recent.begin();
+
+		const auto now = resident += TEXTURE_TILE_BYTES;
+		auto previous = peak.load();
+		while (now > previous && !peak.compare_exchange_weak(previous, now));
+
+		return tile;
+	}
+
+	void report(std::ostream& out) const {
+		const auto lookups = hits + misses;
+
+		out << "Texture cache:\n";
+		out << "  " << lookups << " tile lookups, "
+		    << (lookups ? 100.0 * hits / lookups : 0) << "% hits, "
+		    << evictions << " evictions\n";
+		out << "  " << resident << " bytes resident, " << peak << " bytes peak, "
+		    << capacity << " bytes capacity\n";
+	}
+};
+
+inline texture_tile_cache& shared_texture_cache() {
+	static texture_tile_cache cache(64 * 1024 * 1024);
+	return cache;
+}
+
+// Read only view of a whole file
+struct mapped_file {
+
+	const std::byte* data = nullptr;
+	size_t size = 0;
+
+	mapped_file(const char* path) {
+		const int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return;
+
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size > 0) {
+			void* memory = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (memory != MAP_FAILED) {
+				data = static_cast<const std::byte*>(memory);
+				size = info.st_size;
+			}
+		}
+
+		close(fd);
+	}
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	~mapped_file() {
+		if (data)
+			munmap(const_cast<std::byte*>(data), size);
+	}
+
+	// Drops the pages of a page aligned range, they are read from the file
+	// again if touched later
+	void release(size_t offset, size_t length) const {
+		madvise(const_cast<std::byte*>(data + offset), length, MADV_DONTNEED);
+	}
+};
+
+// Gamma 2, the same curve write_color encodes with
+inline real decode_texel(uint8_t value) {
+	static const auto table = [] {
+		std::vector<real> t(256);
+		for (int i = 0; i < 256; i++)
+			t[i] = real(i * i) / (255 * 255);
+		return t;
+	}();
+
+	return table[value];
+}
+
+inline uint8_t encode_texel(real value) {
+	return color_clamp(std::lround(255 * std::sqrt(value)));
+}
+
+// Writes the mip chain of an 8 bit RGB image, top row first, in the tiled
+// layout. Every level halves the previous one with a box filter.
+inline bool write_tiled_texture(const char* path, int width, int height, const std::vector<uint8_t>& rgb) {
+	tiled_texture_header header = {};
+	std::memcpy(header.magic, TILED_TEXTURE_MAGIC, sizeof(header.magic));
+
+	std::vector<std::vector<uint8_t>> levels{rgb};
+	uint64_t offset = TEXTURE_TILE_BYTES;
+
+	for (int w = width, h = height;; w = std::max(w / 2, 1), h = std::max(h / 2, 1)) {
+		auto& info = header.level_info[header.levels++];
+		info.width = w;
+		info.height = h;
+		info.tiles_x = (w + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		info.tiles_y = (h + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		info.offset = offset;
+		offset += uint64_t(info.tiles_x) * info.tiles_y * TEXTURE_TILE_BYTES;
+
+		if ((w == 1 && h == 1) || header.levels == TEXTURE_MAX_LEVELS)
+			break;
+
+		const int next_w = std::max(w / 2, 1);
+		const int next_h = std::max(h / 2, 1);
+		const auto& previous = levels.back();
+		std::vector<uint8_t> next(size_t(next_w) * next_h * 3);
+
+		for (int y = 0; y < next_h; y++)
+			for (int x = 0; x < next_w; x++)
+				for (int c = 0; c < 3; c++) {
+					real sum = 0;
+					for (int dy = 0; dy < 2; dy++)
+						for (int dx = 0; dx < 2; dx++) {
+							const int sx = std::min(2 * x + dx, w - 1);
+							const int sy = std::min(2 * y + dy, h - 1);
+							sum += decode_texel(previous[(size_t(sy) * w + sx) * 3 + c]);
+						}
+					next[(size_t(y) * next_w + x) * 3 + c] = encode_texel(sum / 4);
+				}
+
+		levels.push_back(std::move(next));
+	}
+
+	// Written aside and renamed, so a concurrent render never maps half a file
+	const auto partial = std::string(path) + ".partial";
+	std::ofstream out(partial, std::ios::binary);
+
+	std::vector<uint8_t> page(TEXTURE_TILE_BYTES);
+	std::memcpy(page.data(), &header, sizeof(header));
+	out.write(reinterpret_cast<const char*>(page.data()), page.size());
+
+	for (uint32_t l = 0; l < header.levels; l++) {
+		const auto& info = header.level_info[l];
+		const auto& texels = levels[l];
+
+		for (uint32_t ty = 0; ty < info.tiles_y; ty++)
+			for (uint32_t tx = 0; tx < info.tiles_x; tx++) {
+				std::fill(page.begin(), page.end(), 0);
+
+				for (int y = 0; y < TEXTURE_TILE_SIZE; y++)
+					for (int x = 0; x < TEXTURE_TILE_SIZE; x++) {
+						const uint32_t sx = tx * TEXTURE_TILE_SIZE + x;
+						const uint32_t sy = ty * TEXTURE_TILE_SIZE + y;
+						if (sx >= info.width || sy >= info.height)
+							continue;
+
+						const auto source = (size_t(sy) * info.width + sx) * 3;
+						const auto target = (y * TEXTURE_TILE_SIZE + x) * 4;
+						page[target + 0] = texels[source + 0];
+						page[target + 1] = texels[source + 1];
+						page[target + 2] = texels[source + 2];
+						page[target + 3] = 255;
+					}
+
+				out.write(reinterpret_cast<const char*>(page.data()), page.size());
+			}
+	}
+
+	out.close();
+	return out && std::rename(partial.c_str(), path) == 0;
+}
+
+// Mipmapped image read tile by tile from its tiled file through the cache
+struct tiled_image {
+
+	mapped_file file;
+	const tiled_texture_header* header = nullptr;
+	uint32_t id;
+	texture_tile_cache& cache;
+
+	tiled_image(const char* path, texture_tile_cache& cache)
+	    : file{path}, id{cache.register_texture()}, cache{cache} {
+		const auto candidate = reinterpret_cast<const tiled_texture_header*>(file.data);
+
+		if (file.size >= TEXTURE_TILE_BYTES && std::memcmp(candidate->magic, TILED_TEXTURE_MAGIC, sizeof(candidate->magic)) == 0)
+			header = candidate;
+	}
+
+	bool valid() const {
+		return header != nullptr;
+	}
+
+	// Opens the tiled version of a PPM, converting it first if it is
+	// missing or older than the image. Returns null if neither can be read.
+	static std::unique_ptr<tiled_image> open_ppm(const char* source, texture_tile_cache& cache) {
+		const auto tiled = std::string(source) + ".tiles";
+
+		struct stat source_info, tiled_info;
+		const bool has_source = stat(source, &source_info) == 0;
+		const bool has_tiled = stat(tiled.c_str(), &tiled_info) == 0;
+
+		if (has_source && (!has_tiled || tiled_info.st_mtime < source_info.st_mtime)) {
+			int width, height;
+			std::vector<uint8_t> rgb;
+			if (!read_ppm(source, width, height, rgb) || !write_tiled_texture(tiled.c_str(), width, height, rgb))
+				return nullptr;
+		}
+
+		auto image = std::make_unique<tiled_image>(tiled.c_str(), cache);
+		return image->valid() ? std::move(image) : nullptr;
+	}
+
+	int levels() const {
+		return header->levels;
+	}
+
+	// Texel of a level, wrapping around both edges
+	vec3 texel(int level, int x, int y) const {
+		const auto& info = header->level_info[level];
+
+		x %= int(info.width);
+		y %= int(info.height);
+		if (x < 0) x += info.width;
+		if (y < 0) y += info.height;
+
+		const uint32_t tx = x / TEXTURE_TILE_SIZE;
+		const uint32_t ty = y / TEXTURE_TILE_SIZE;
+		const auto key = texture_tile_cache::tile_key(id, level, tx, ty);
+
+		// A few tiles per thread skip the cache lock while a lookup stays
+		// within them, which is the common case for neighbouring samples
+		struct recent_tile {
+			uint64_t key = UINT64_MAX;
+			std::shared_ptr<const texture_tile> tile;
+		};
+		thread_local recent_tile recent[8];
+
+		auto& slot = recent[(level + tx + ty) % 8];
+		if (slot.key != key) {
+			slot.tile = cache.fetch(key, [&](texture_tile& tile) {
+				const auto offset = info.offset + (uint64_t(ty) * info.tiles_x + tx) * TEXTURE_TILE_BYTES;
+				std::memcpy(tile.texels, file.data + offset, TEXTURE_TILE_BYTES);
+				file.release(offset, TEXTURE_TILE_BYTES);
+			});
+			slot.key = key;
+		}
+
+		const auto* t = slot.tile->texels + ((y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + x % TEXTURE_TILE_SIZE) * 4;
+		return vec3(decode_texel(t[0]), decode_texel(t[1]), decode_texel(t[2]));
+	}
+
+	// s and t in [0, 1], t = 0 being the top row
+	vec3 bilinear(int level, real s, real t) const {
+		const auto& info = header->level_info[level];
+
+		const real x = s * info.width - real(0.5);
+		const real y = t * info.height - real(0.5);
+		const int x0 = std::floor(x);
+		const int y0 = std::floor(y);
+		const real fx = x - x0;
+		const real fy = y - y0;
+
+		return (1 - fx) * (1 - fy) * texel(level, x0, y0)
+		     + fx * (1 - fy) * texel(level, x0 + 1, y0)
+		     + (1 - fx) * fy * texel(level, x0, y0 + 1)
+		     + fx * fy * texel(level, x0 + 1, y0 + 1);
+	}
+
+	// Blends the two levels whose texels are closest in size to `width`,
+	// a filter width in the same [0, 1] units as s and t
+	vec3 trilinear(real s, real t, real width) const {
+		const auto& base = header->level_info[0];
+		const real texels = width * std::max(base.width, base.height);
+		const real level = std::clamp(std::log2(std::max(texels, real(1))), real(0), real(levels() - 1));
+
+		const int fine = level;
+		const real blend = level - fine;
+		if (blend == 0)
+			return bilinear(fine, s, t);
+
+		return (1 - blend) * bilinear(fine, s, t) + blend * bilinear(fine + 1, s, t);
+	}
+};
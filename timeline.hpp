@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+
+// Timeline of what every thread did, written as Chrome trace JSON that
+// chrome://tracing and ui.perfetto.dev open. Each thread appends finished
+// events to its own buffer, found through a thread_local pointer, so
+// recording takes no lock. Buffers are linked into a list the first time a
+// thread records, and read when the trace is written, which must happen
+// once no thread records anymore.
+//
+// While disabled a timeline_scope only reads one flag, so scopes can stay
+// in the hot loops.
+
+struct timeline_event {
+	const char* category;
+	const char* name;
+	const char* argument_name;
+	int64_t argument;
+	int64_t start;
+	int64_t duration;
+};
+
+struct timeline {
+
+	struct thread_buffer {
+		std::vector<timeline_event> events;
+		int thread = 0;
+		thread_buffer* next = nullptr;
+	};
+
+	std::atomic<bool> enabled{false};
+	std::atomic<thread_buffer*> buffers{nullptr};
+	std::atomic<int> threads{0};
+
+	const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+	timeline() = default;
+	timeline(const timeline&) = delete;
+
+	~timeline() {
+		for (auto b = buffers.load(); b;) {
+			const auto next = b->next;
+			delete b;
+			b = next;
+		}
+	}
+
+	bool on() const {
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	// Nanoseconds since the timeline was created
+	int64_t now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	thread_buffer& local() {
+		thread_local thread_buffer* buffer = nullptr;
+		if (buffer)
+			return *buffer;
+
+		buffer = new thread_buffer;
+		buffer->thread = threads++;
+		buffer->events.reserve(1024);
+
+		buffer->next = buffers.load();
+		while (!buffers.compare_exchange_weak(buffer->next, buffer))
+			;
+
+		return *buffer;
+	}
+
+	void record(const timeline_event& e) {
+		local().events.push_back(e);
+	}
+
+	// Names are expected to be literals without quotes or backslashes
+	bool write(const char* path) const {
+		// Microseconds to the nanosecond, the default six digits would round
+		// them after a second
+		std::ofstream out(path);
+		out << std::fixed << std::setprecision(3);
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+		bool first = true;
+		for (auto b = buffers.load(); b; b = b->next) {
+			out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->thread
+			    << ",\"args\":{\"name\":\"thread " << b->thread << "\"}}";
+			first = false;
+
+			for (const auto& e : b->events) {
+				out << ",\n{\"name\":\"" << e.name << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->thread
+				    << ",\"ts\":" << e.start / 1e3 << ",\"dur\":" << e.duration / 1e3;
+				if (e.argument_name)
+					out << ",\"args\":{\"" << e.argument_name << "\":" << e.argument << '}';
+				out << '}';
+			}
+		}
+
+		out << "\n]}\n";
+		return bool(out);
+	}
+
+	size_t events() const {
+		size_t count = 0;
+		for (auto b = buffers.load(); b; b = b->next)
+			count += b->events.size();
+		return count;
+	}
+};
+
+inline timeline& shared_timeline() {
+	static timeline t;
+	return t;
+}
+
+// Records the time from its construction to its destruction, or to end(),
+// as one event of the shared timeline, with an optional integer argument
+struct timeline_scope {
+	const char* category;
+	const char* name;
+	const char* argument_name;
+	int64_t argument;
+	int64_t start = -1;
+
+	timeline_scope(const char* category, const char* name, const char* argument_name = nullptr, int64_t argument = 0)
+		: category{category}, name{name}, argument_name{argument_name}, argument{argument} {
+		if (shared_timeline().on())
+			start = shared_timeline().now();
+	}
+
+	timeline_scope(const timeline_scope&) = delete;
+
+	~timeline_scope() {
+		end();
+	}
+
+	void end() {
+		if (start < 0)
+			return;
+
+		auto& t = shared_timeline();
+		t.record({category, name, argument_name, argument, start, t.now() - start});
+		start = -1;
+	}
+};
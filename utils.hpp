@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <random>
 
 #include "vec3.hpp"
@@ -10,10 +11,16 @@ inline double unit_map(double x) {
 	return 0.5 * (x + 1);
 }
 
+// Each thread owns a generator, seeded in the order threads first ask for one
+inline std::mt19937& random_generator() {
+	static std::atomic<unsigned> next_seed{0};
+	thread_local std::mt19937 generator(next_seed++);
+	return generator;
+}
+
 inline double random_double(double min = 0, double max = 1) {
-	static std::uniform_real_distribution<double> distribution(min, max);
-	static std::mt19937 generator;
-	return distribution(generator);
+	static thread_local std::uniform_real_distribution<double> distribution(0, 1);
+	return min + (max - min) * distribution(random_generator());
 }
 
 inline int random_int(int min, int max) {
@@ -24,7 +31,7 @@ inline vec3 vec3_unit_map(const vec3& v) {
 	return 0.5 * (v + vec3(1, 1, 1));
 }
 
-inline vec3 vec3_lerp(const vec3& origin, const vec3& destination, double t) {
+inline vec3 vec3_lerp(const vec3& origin, const vec3& destination, real t) {
 	return (1 - t) * origin + t * destination;
 }
 
@@ -32,31 +39,56 @@ inline vec3 vec3_random(double min = 0, double max = 1) {
 	return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
 }
 
+// The mappings below take uniform numbers in [0, 1) so samplers can feed
+// them stratified or low discrepancy points.
+
+// Uniform direction, from the cylindrical projection of the sphere
+vec3 random_unit_vector(real u1, real u2) {
+	const auto z = 1 - 2 * u1;
+	const auto r = std::sqrt(std::fmax(real(0), 1 - z * z));
+	const auto phi = 2 * PI * u2;
+	return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+vec3 random_in_unit_sphere(real u1, real u2, real u3) {
+	return std::cbrt(u3) * random_unit_vector(u1, u2);
+}
+
+// Shirley and Chiu's concentric mapping, keeps strata compact
+vec3 random_in_unit_disk(real u1, real u2) {
+	const auto x = 2 * u1 - 1;
+	const auto y = 2 * u2 - 1;
+
+	if (x == 0 && y == 0)
+		return vec3(0, 0, 0);
+
+	real r, theta;
+	if (std::fabs(x) > std::fabs(y)) {
+		r = x;
+		theta = PI / 4 * (y / x);
+	} else {
+		r = y;
+		theta = PI / 2 - PI / 4 * (x / y);
+	}
+
+	return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
 vec3 random_in_unit_sphere() {
-	vec3 point;
-	do
-		point = vec3_random(-1, 1);	
-	while(point.length_squared() >= 1);
-	return point;
+	return random_in_unit_sphere(random_double(), random_double(), random_double());
 }
 
 vec3 random_in_unit_disk() {
-	vec3 point;
-	do {
-		point = vec3_random(-1, 1);
-		point.z = 0;
-	} while(point.length_squared() >= 1);
-	return point;
+	return random_in_unit_disk(random_double(), random_double());
 }
 
 vec3 random_unit_vector() {
-	const auto not_normalized = random_in_unit_sphere();
-	return unit_vector(not_normalized);
+	return random_unit_vector(random_double(), random_double());
 }
 
-vec3 refract(const vec3& in, const vec3& n, double dielectric_ratio) {
-	auto cos_theta = fmin(dot(-in, n), 1.0);
+vec3 refract(const vec3& in, const vec3& n, real dielectric_ratio) {
+	auto cos_theta = std::fmin(dot(-in, n), real(1));
 	vec3 out_perpendicular = dielectric_ratio * (in + cos_theta * n);
-	vec3 out_parallel = -sqrt(fabs(1.0 - out_perpendicular.length_squared())) * n;
+	vec3 out_parallel = -std::sqrt(std::fabs(1 - out_perpendicular.length_squared())) * n;
 	return out_perpendicular + out_parallel;
 }
\ No newline at end of file
@@ -4,107 +4,155 @@
 #include <iostream>
 #include <exception>
 #include <cassert>
-
-struct vec3 {
-	float x;
-	float y;
-	float z;
-
-	vec3() : x{0}, y{0}, z{0} {}
-	vec3(float x, float y, float z) : x{x}, y{y}, z{z} {}
-	vec3(const vec3& v) : x{v.x}, y{v.y}, z{v.z} {}
-
-	float operator[](int s) const {
+#include <limits>
+#include <type_traits>
+
+// Scalar type of the math core. Float by default, build with -DRT_DOUBLE
+// for double precision everywhere.
+#ifdef RT_DOUBLE
+using real = double;
+#else
+using real = float;
+#endif
+
+constexpr real PI = static_cast<real>(M_PI);
+
+template<typename T>
+struct vec3_t {
+	T x;
+	T y;
+	T z;
+
+	constexpr vec3_t() : x{0}, y{0}, z{0} {}
+	constexpr vec3_t(T x, T y, T z) : x{x}, y{y}, z{z} {}
+	vec3_t(const vec3_t& v) : x{v.x}, y{v.y}, z{v.z} {}
+	vec3_t& operator=(const vec3_t& v) = default;
+
+	T operator[](int s) const {
 		switch (s) {
 			case 0: return x;
 			case 1: return y;
 			case 2: return z;
-			default: assert(0);
+			default: assert(0); return 0;
 		}
 	}
 
-	vec3 operator-() const {
-		return vec3(-x, -y, -z);
+	vec3_t operator-() const {
+		return vec3_t(-x, -y, -z);
 	}
 
-	vec3& operator+=(const vec3& v) {
+	vec3_t& operator+=(const vec3_t& v) {
 		x += v.x;
 		y += v.y;
 		z += v.z;
 		return *this;
 	}
 
-	vec3& operator*=(const float c) {
+	vec3_t& operator*=(const T c) {
 		x *= c;
 		y *= c;
 		z *= c;
 		return *this;
 	}
 
-	vec3& operator/=(const float c) {
+	vec3_t& operator/=(const T c) {
 		return *this *= 1 / c;
 	}
 
-	float length_squared() const {
+	T length_squared() const {
 		return x * x + y * y + z * z;
 	}
 
-	float length() const {
+	T length() const {
 		return std::sqrt(length_squared());
 	}
 
 	bool zero() const {
-		const auto s = 1e-8;
-		return (fabs(x) < s) && (fabs(y) < s) && (fabs(z) < s);
+		const T s = 1e-8;
+		return (std::fabs(x) < s) && (std::fabs(y) < s) && (std::fabs(z) < s);
 	}
 };
 
-inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
+using vec3 = vec3_t<real>;
+
+template<typename T>
+inline std::ostream& operator<<(std::ostream& out, const vec3_t<T>& v) {
 	return out << '(' << v.x << ", " << v.y << ", " << v.z << ')';
 }
 
-inline vec3 operator+(const vec3& u, const vec3& v) {
-	return vec3(u.x + v.x, u.y + v.y, u.z + v.z);
+template<typename T>
+inline vec3_t<T> operator+(const vec3_t<T>& u, const vec3_t<T>& v) {
+	return vec3_t<T>(u.x + v.x, u.y + v.y, u.z + v.z);
 }
 
-inline vec3 operator-(const vec3& u, const vec3& v) {
-	return vec3(u.x - v.x, u.y - v.y, u.z - v.z);
+template<typename T>
+inline vec3_t<T> operator-(const vec3_t<T>& u, const vec3_t<T>& v) {
+	return vec3_t<T>(u.x - v.x, u.y - v.y, u.z - v.z);
 }
 
-inline vec3 operator*(const vec3& u, const vec3& v) {
-	return vec3(u.x * v.x, u.y * v.y, u.z * v.z);
+template<typename T>
+inline vec3_t<T> operator*(const vec3_t<T>& u, const vec3_t<T>& v) {
+	return vec3_t<T>(u.x * v.x, u.y * v.y, u.z * v.z);
 }
 
-inline vec3 operator*(float t, const vec3& v) {
-	return vec3(t * v.x, t * v.y, t * v.z);
+// Scalars of any arithmetic type are converted to the vector's own type
+// first, so mixing in a double literal never promotes the computation
+template<typename T, typename S, typename = std::enable_if_t<std::is_arithmetic_v<S>>>
+inline vec3_t<T> operator*(S t, const vec3_t<T>& v) {
+	const T c = static_cast<T>(t);
+	return vec3_t<T>(c * v.x, c * v.y, c * v.z);
 }
 
-inline vec3 operator*(const vec3& v, float t) {
+template<typename T, typename S, typename = std::enable_if_t<std::is_arithmetic_v<S>>>
+inline vec3_t<T> operator*(const vec3_t<T>& v, S t) {
 	return t * v;
 }
 
-inline vec3 operator/(const vec3& v, float t) {
-	return (1 / t) * v;
+template<typename T, typename S, typename = std::enable_if_t<std::is_arithmetic_v<S>>>
+inline vec3_t<T> operator/(const vec3_t<T>& v, S t) {
+	return (1 / static_cast<T>(t)) * v;
 }
 
-inline float dot(const vec3& u, const vec3& v) {
+template<typename T>
+inline T dot(const vec3_t<T>& u, const vec3_t<T>& v) {
 	return u.x * v.x + u.y * v.y + u.z * v.z;
 }
 
-inline vec3 cross(const vec3& u, const vec3& v) {
-	return vec3(
+template<typename T>
+inline vec3_t<T> cross(const vec3_t<T>& u, const vec3_t<T>& v) {
+	return vec3_t<T>(
 		u.y * v.z - v.y * u.z,
 		u.z * v.x - u.x * v.z,
 		u.x * v.y - u.y * v.x);
 }
 
-inline vec3 unit_vector(const vec3& v) {
+template<typename T>
+inline vec3_t<T> unit_vector(const vec3_t<T>& v) {
 	if (!v.length())
 		throw std::logic_error("null vector has no unit vector");
 
 	return v / v.length();
 }
 
-inline vec3 reflect(const vec3& v, const vec3& n) {
+template<typename T>
+inline vec3_t<T> reflect(const vec3_t<T>& v, const vec3_t<T>& n) {
 	return v - 2 * dot(v, n) * n;
 }
+
+template<typename T>
+inline T max_component(const vec3_t<T>& v) {
+	return std::fmax(v.x, std::fmax(v.y, v.z));
+}
+
+template<typename T>
+inline vec3_t<T> vec3_abs(const vec3_t<T>& v) {
+	return vec3_t<T>(std::fabs(v.x), std::fabs(v.y), std::fabs(v.z));
+}
+
+// Bound on the relative error of n chained floating point operations,
+// from Pharr et al., "Physically Based Rendering", section 3.9
+template<typename T>
+constexpr T gamma_bound(int n) {
+	constexpr T e = std::numeric_limits<T>::epsilon() / 2;
+	return (n * e) / (1 - n * e);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+
+#include "vec3.hpp"
+
+// Views written as key=value fields in any order, as the render server's
+// jobs and the view lists of views.cpp are:
+//
+//     width=200 height=200 spp=64 from=0,0,100 at=0,0,-100 fov=45
+//
+// Fields a view doesn't mention keep the values it had.
+
+inline bool parse_vec3(const std::string& text, vec3& v) {
+	real x, y, z;
+	char c1, c2;
+	std::istringstream in(text);
+	if (!(in >> x >> c1 >> y >> c2 >> z) || c1 != ',' || c2 != ',')
+		return false;
+
+	v = vec3(x, y, z);
+	return true;
+}
+
+// Fills the image and camera fields of a view, anything with width, height,
+// samples, from, at, fov, aperture and focus members, from the rest of a
+// line. Other keys go to other(key, value, ok), which returns false for keys
+// it doesn't know and clears ok for values it can't read. Returns an error
+// message or an empty string.
+template<typename View, typename F>
+std::string parse_view_fields(std::istringstream& fields, View& view, F&& other) {
+	std::string field;
+	while (fields >> field) {
+		const auto equals = field.find('=');
+		if (equals == std::string::npos)
+			return "malformed field " + field;
+
+		const auto key = field.substr(0, equals);
+		const auto value = field.substr(equals + 1);
+		std::istringstream in(value);
+		bool ok = true;
+
+		if (key == "width") ok = bool(in >> view.width);
+		else if (key == "height") ok = bool(in >> view.height);
+		else if (key == "spp") ok = bool(in >> view.samples);
+		else if (key == "fov") ok = bool(in >> view.fov);
+		else if (key == "aperture") ok = bool(in >> view.aperture);
+		else if (key == "focus") ok = bool(in >> view.focus);
+		else if (key == "from") ok = parse_vec3(value, view.from);
+		else if (key == "at") ok = parse_vec3(value, view.at);
+		else if (!other(key, value, ok)) return "unknown field " + key;
+
+		if (!ok)
+			return "bad value for " + key;
+	}
+
+	if (view.width < 2 || view.height < 2 || view.samples < 1)
+		return "resolution and spp must be positive";
+
+	return "";
+}
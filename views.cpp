@@ -0,0 +1,277 @@
+// Renders one scene from many cameras in a single run: turntables, stereo
+// pairs, lookdev grids. The scene and its acceleration structures are built
+// once and shared by every view, and the tiles of all views go through one
+// queue, so threads that finish one view move straight on to the next.
+//
+//     g++ -O3 -fopenmp views.cpp -o views && ./views views.txt
+//
+// The list has one view per line, as key=value fields in any order, with
+// the same names as the render server's jobs:
+//
+//     output=left.png from=-0.3,2,13 at=0,0,0 fov=20 aperture=0 focus=10
+//     output=right.png from=0.3,2,13 at=0,0,0 fov=20 aperture=0 focus=10
+//
+// Missing fields keep the values of view_definition. Outputs ending in .png,
+// .exr or .pfm get that format, anything else is PPM. Lines starting with #
+// are skipped. Without a list, TURNTABLE_VIEWS views around the scene are
+// rendered to turntable_<n>.png.
+//
+// Each view is written by the thread that finishes its last tile while the
+// others carry on with the next views, and reported with the time since
+// rendering started.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
+#include "camera.hpp"
+#include "image.hpp"
+#include "image_writer.hpp"
+#include "light_tree.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scenes.hpp"
+#include "static_scene.hpp"
+#include "view_fields.hpp"
+
+constexpr int SCENE = 1;
+constexpr int MAX_RAY_DEPTH = 8;
+constexpr int TILE_SIZE = 16;
+constexpr sampler_type SAMPLER = sampler_type::sobol;
+
+constexpr int TURNTABLE_VIEWS = 8;
+
+const vec3 BACKGROUND(0.5, 0.5, 0.5);
+
+struct view_definition {
+	std::string output;
+
+	int width = 320;
+	int height = 180;
+	int samples = 32;
+
+	vec3 from = vec3(13, 2, 3);
+	vec3 at = vec3(0, 0, 0);
+	real fov = 20;
+	real aperture = 0;
+	real focus = 10;
+};
+
+// A view being rendered, with its frame buffer, rows from the bottom as in
+// camera space
+struct view_state {
+	view_definition definition;
+	std::unique_ptr<camera> view;
+	std::vector<vec3> pixels;
+
+	int tiles_x = 0;
+	int tiles = 0;
+	std::atomic<int> remaining{0};
+
+	view_state(const view_definition& d) : definition{d} {
+		view = std::make_unique<camera>(d.from, d.at, vec3(0, 1, 0), d.fov * PI / 180, real(d.width) / d.height, d.aperture, d.focus);
+		view->set_image_height(d.height);
+
+		pixels.resize(size_t(d.width) * d.height);
+
+		tiles_x = (d.width + TILE_SIZE - 1) / TILE_SIZE;
+		tiles = tiles_x * ((d.height + TILE_SIZE - 1) / TILE_SIZE);
+		remaining = tiles;
+	}
+
+	template<typename Scene>
+	void render_tile(int tile, const Scene& scene, sampler& s) {
+		const auto& d = definition;
+		const int x0 = tile % tiles_x * TILE_SIZE;
+		const int y0 = tile / tiles_x * TILE_SIZE;
+		const int x1 = std::min(x0 + TILE_SIZE, d.width);
+		const int y1 = std::min(y0 + TILE_SIZE, d.height);
+
+		for (int j = y0; j < y1; j++)
+			for (int i = x0; i < x1; i++) {
+				vec3 color(0, 0, 0);
+				for (int k = 0; k < d.samples; k++) {
+					s.start_sample(i, j, k);
+
+					real du, dv;
+					s.get_2d(du, dv);
+
+					const ray r = view->shoot_ray((i + du) / (d.width - 1), (j + dv) / (d.height - 1), s);
+					color += ray_color(r, BACKGROUND, scene, s, MAX_RAY_DEPTH);
+				}
+
+				pixels[size_t(j) * d.width + i] = color / d.samples;
+			}
+	}
+
+	bool write() const {
+		const auto& d = definition;
+		const auto ends_with = [&](const char* suffix) {
+			const std::string s(suffix);
+			return d.output.size() >= s.size() && d.output.compare(d.output.size() - s.size(), s.size(), s) == 0;
+		};
+
+		const auto pixel = [this](int x, int y) {
+			return pixels[size_t(definition.height - 1 - y) * definition.width + x];
+		};
+
+		if (ends_with(".png"))
+			return image_writer(image_format::png, d.width, d.height, pixel).write(d.output.c_str());
+		if (ends_with(".exr"))
+			return image_writer(image_format::exr, d.width, d.height, pixel).write(d.output.c_str());
+		if (ends_with(".pfm"))
+			return image_writer(image_format::pfm, d.width, d.height, pixel).write(d.output.c_str());
+
+		std::ofstream out(d.output, std::ios::binary);
+		out << "P6\n" << d.width << ' ' << d.height << "\n255\n";
+		for (int y = 0; y < d.height; y++)
+			for (int x = 0; x < d.width; x++)
+				write_color(out, pixel(x, y), 1);
+		return bool(out);
+	}
+};
+
+// Fills a view from the fields of a line, returns an error message or an
+// empty string
+std::string parse_view(std::istringstream& fields, view_definition& d) {
+	const auto error = parse_view_fields(fields, d, [&](const std::string& key, const std::string& value, bool&) {
+		if (key != "output")
+			return false;
+
+		d.output = value;
+		return true;
+	});
+
+	if (!error.empty())
+		return error;
+	if (d.output.empty())
+		return "no output";
+
+	return "";
+}
+
+bool read_views(const char* path, std::vector<view_definition>& views) {
+	std::ifstream in(path);
+	if (!in) {
+		std::cerr << "Could not read " << path << '\n';
+		return false;
+	}
+
+	std::string line;
+	for (int number = 1; std::getline(in, line); number++) {
+		std::istringstream fields(line);
+		std::string first;
+		if (!(fields >> first) || first[0] == '#')
+			continue;
+
+		fields.seekg(0);
+		view_definition d;
+		const auto error = parse_view(fields, d);
+		if (!error.empty()) {
+			std::cerr << path << ':' << number << ": " << error << '\n';
+			return false;
+		}
+		views.push_back(d);
+	}
+
+	return true;
+}
+
+std::vector<view_definition> turntable() {
+	std::vector<view_definition> views(TURNTABLE_VIEWS);
+	for (int n = 0; n < TURNTABLE_VIEWS; n++) {
+		auto& d = views[n];
+		const auto angle = 2 * PI * n / TURNTABLE_VIEWS;
+		const auto start = d.from;
+		d.from = vec3(start.x * std::cos(angle) - start.z * std::sin(angle), start.y, start.x * std::sin(angle) + start.z * std::cos(angle));
+		d.output = "turntable_" + std::to_string(n) + ".png";
+	}
+	return views;
+}
+
+int main(int argc, char** argv) {
+	const double start_time = 0;
+	const double end_time = 1;
+
+	std::vector<view_definition> definitions;
+	if (argc > 1) {
+		if (!read_views(argv[1], definitions))
+			return 1;
+	} else {
+		definitions = turntable();
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+
+	random_generator().seed(SCENE);
+
+	scene_arena arena;
+	const auto world = choose_scene(SCENE, arena);
+	const light_tree lights(world, start_time, end_time);
+	const static_scene scene(world, start_time, end_time, &lights);
+
+	const std::chrono::duration<double> setup = std::chrono::steady_clock::now() - start;
+	std::cerr << "Loaded scene " << SCENE << " (" << scene_name(SCENE) << ") in " << setup.count() << "s\n";
+
+	// Tile t of the queue belongs to the last view whose first tile is at
+	// or before it
+	std::vector<std::unique_ptr<view_state>> views;
+	std::vector<int> first_tile;
+	int tiles = 0;
+	long samples = 0;
+
+	for (const auto& d : definitions) {
+		views.push_back(std::make_unique<view_state>(d));
+		first_tile.push_back(tiles);
+		tiles += views.back()->tiles;
+		samples += long(d.width) * d.height * d.samples;
+	}
+
+	const auto render_start = std::chrono::steady_clock::now();
+
+	std::atomic<int> next_tile{0};
+	int failed = 0;
+
+	#pragma omp parallel reduction(+ : failed)
+	{
+		// Samplers are made for a sample count, so each view gets its own
+		std::vector<std::unique_ptr<sampler>> samplers(views.size());
+
+		for (int t; (t = next_tile++) < tiles;) {
+			const int index = std::upper_bound(first_tile.begin(), first_tile.end(), t) - first_tile.begin() - 1;
+			auto& v = *views[index];
+
+			if (!samplers[index])
+				samplers[index] = make_sampler(SAMPLER, v.definition.samples);
+
+			v.render_tile(t - first_tile[index], scene, *samplers[index]);
+
+			if (--v.remaining == 0) {
+				const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - render_start;
+
+				if (!v.write()) {
+					failed++;
+					#pragma omp critical
+					std::cerr << "Could not write " << v.definition.output << '\n';
+				} else {
+					#pragma omp critical
+					std::cerr << "Wrote " << v.definition.output << " after " << elapsed.count() << "s\n";
+				}
+			}
+		}
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - render_start;
+	std::cerr << views.size() << " views in " << elapsed.count() << "s, "
+	          << samples / elapsed.count() / 1e6 << " M samples/s\n";
+
+	return failed ? 1 : 0;
+}